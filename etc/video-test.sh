@@ -7,3 +7,10 @@ sudo modprobe v4l2loopback
 gst-launch-1.0 videotestsrc pattern=solid-color foreground-color=0xE0F0E0 ! \
 "video/x-raw,format=RGBx,width=800,height=600,framerate=20/1,interlace-mode=progressive" ! \
 v4l2sink device=/dev/video0
+
+# DMABUF import can be tested with the vivid driver instead (set `video_dmabuf = true`),
+# software rendering is selected by `LIBGL_ALWAYS_SOFTWARE=1`
+#sudo modprobe vivid
+
+# Recorded MJPEG file can be replayed by setting `video_device` to its path
+#gst-launch-1.0 v4l2src device=/dev/video0 ! image/jpeg,width=800,height=600 ! filesink location=etc/video.mjpg
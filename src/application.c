@@ -22,10 +22,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 
 #include "debug.h"
+#include "profile.h"
 #include "application.h"
 #include "graphics.h"
+#include "capture.h"
 #include "video.h"
 #include "gps.h"
 #include "imu.h"
@@ -34,6 +42,7 @@ struct _application
 {
     imu_t *imu;
     gps_t *gps;
+    capture_t *capture;
     video_t *video;
     graphics_t *graphics;
     atlas_t *atlas1, *atlas2;
@@ -41,12 +50,32 @@ struct _application
     hud_t *hud;
 
     uint32_t video_width, video_height, window_width, window_height;
-    float video_hfov, video_vfov;
+    float video_scale, video_hfov, video_vfov;
     float visible_distance;
     uint8_t label_color[4];
+    uint32_t label_size;
+    bool label_sdf;
+    volatile sig_atomic_t running;
+
+    bool event_loop;
+    float render_rate;
+    uint32_t wakeups;
+
+    // Frame returned by last video read, not yet shown
+    void *frame_data;
+    size_t frame_length;
+    bool frame_pending;
 
     struct gps_config gps_config;
     struct imu_config imu_config;
+    struct video_config video_config;
+    struct graphics_config graphics_config;
+
+    // Rendered frames and their limit
+    uint32_t frames, frame_limit;
+
+    // Time of initialization, cleared when the first frame is shown
+    struct timespec start;
 };
 
 /* GPS API handler for label creation */
@@ -57,9 +86,12 @@ void* create_label_handler(const char *text, void *userdata)
     assert(userdata != 0);
 
     application_t *app = (application_t*)userdata;
-    drawable_t *label = graphics_label_create(app->graphics, app->atlas2, ANCHOR_CENTER_TOP);
+    PROFILE_BEGIN(LABEL);
+    drawable_t *label = graphics_label_create(app->graphics, app->atlas2 ? app->atlas2 : app->atlas1, ANCHOR_CENTER_TOP);
+    graphics_label_set_size(label, app->label_size);
     graphics_label_set_text(label, text);
     graphics_label_set_color(label, app->label_color);
+    PROFILE_END(LABEL);
     return label;
 }
 
@@ -76,27 +108,50 @@ application_t *application_init(struct config *cfg)
 
     application_t *app = calloc(1, sizeof(struct _application));
     assert(app != 0);
+    clock_gettime(CLOCK_MONOTONIC, &app->start);
 
     // Initialize graphics
-    if(!(app->graphics = graphics_init(cfg->app_window_id)))
+    memcpy(&app->graphics_config, &cfg->graphics_conf, sizeof(struct graphics_config));
+    app->graphics_config.width = cfg->window_width;
+    app->graphics_config.height = cfg->window_height;
+    app->graphics_config.decode_yuv = cfg->video_conf.decode_yuv;
+    if(cfg->app_event_loop && (app->graphics_config.frame_rate > 0))
+    {
+        // Event loop paces rendering by its own timer, blocking in flush would stall the loop
+        WARN("Frame rate ignored in event loop mode, use render rate instead");
+        app->graphics_config.frame_rate = 0;
+    }
+    if(!(app->graphics = graphics_init(cfg->app_window_id, &app->graphics_config)))
     {
         ERROR("Cannot initialize graphics");
         goto error;
     }
 
-    // Create atlases
-    if(!(app->atlas1 = graphics_atlas_create(cfg->graphics_font_file, cfg->graphics_font_size_1)) ||
-       !(app->atlas2 = graphics_atlas_create(cfg->graphics_font_file, cfg->graphics_font_size_2)))
+    // Create atlases, distance field atlas serves both font sizes
+    app->label_size = cfg->graphics_font_size_2;
+    app->label_sdf = cfg->graphics_font_sdf;
+    if(!(app->atlas1 = graphics_atlas_create(cfg->graphics_font_file, cfg->graphics_font_size_1, cfg->graphics_font_sdf, cfg->graphics_atlas_cache)) ||
+       (!cfg->graphics_font_sdf && !(app->atlas2 = graphics_atlas_create(cfg->graphics_font_file, cfg->graphics_font_size_2, false, cfg->graphics_atlas_cache))))
     {
         ERROR("Cannot create atlas");
         goto error;
     }
 
-    // Create image
-    if(!(app->image = graphics_image_create(app->graphics, cfg->video_width, cfg->video_height, cfg->video_format, ANCHOR_CENTER)))
+    // DMABUF import is only possible for uncompressed formats
+    memcpy(&app->video_config, &cfg->video_conf, sizeof(struct video_config));
+    if(app->video_config.dmabuf && (strncmp(cfg->video_format, "MJPG", 4) == 0))
     {
-        ERROR("Cannot create image");
-        goto error;
+        WARN("DMABUF import is not supported for MJPEG, disabling");
+        app->video_config.dmabuf = false;
+    }
+
+    // Video fills the window, decode only as much as is visible
+    float scale = (float)cfg->window_width / (float)cfg->window_height < (float)cfg->video_width / (float)cfg->video_height ?
+                  (float)cfg->window_height / (float)cfg->video_height : (float)cfg->window_width / (float)cfg->video_width;
+    if(scale < 1)
+    {
+        app->video_config.decode_width = ceilf(cfg->video_width * scale);
+        app->video_config.decode_height = ceilf(cfg->video_height * scale);
     }
 
     // Create HUD
@@ -108,6 +163,7 @@ application_t *application_init(struct config *cfg)
 
     // Initialize GPS
     memcpy(&app->gps_config, &cfg->gps_conf, sizeof(struct gps_config));
+    app->gps_config.polled = cfg->app_event_loop;
     app->gps_config.userdata = app;
     app->gps_config.create_label = create_label_handler;
     app->gps_config.delete_label = delete_label_handler;
@@ -119,32 +175,83 @@ application_t *application_init(struct config *cfg)
 
     // Initialize IMU
     memcpy(&app->imu_config, &cfg->imu_conf, sizeof(struct imu_config));
+    app->imu_config.polled = cfg->app_event_loop;
     if(!(app->imu = imu_init(cfg->imu_device, &app->imu_config)))
     {
         ERROR("Cannot initialize IMU");
         goto error;
     }
 
-    // Open video
-    if(!(app->video = video_open(cfg->video_device, cfg->video_width, cfg->video_height, cfg->video_format, cfg->video_interlace)))
+    // MJPEG is always decoded by the capture stage
+    if(app->video_config.dmabuf || (cfg->app_event_loop && strncmp(cfg->video_format, "MJPG", 4)))
     {
-        ERROR("Cannot open video device");
-        goto error;
+        // Open video for direct import or polling
+        if(!(app->video = video_open(cfg->video_device, cfg->video_width, cfg->video_height, cfg->video_format, cfg->video_interlace, &app->video_config)))
+        {
+            ERROR("Cannot open video device");
+            goto error;
+        }
+
+        // Recorded files cannot be polled, use capture thread instead
+        if(cfg->app_event_loop && (video_get_fd(app->video) == -1))
+        {
+            video_close(app->video);
+            app->video = NULL;
+        }
     }
 
-    // Copy arguments
+    if(!app->video)
+    {
+        // Start video capture
+        if(!(app->capture = capture_start(cfg->video_device, cfg->video_width, cfg->video_height, cfg->video_format, cfg->video_interlace, &app->video_config)))
+        {
+            ERROR("Cannot start video capture");
+            goto error;
+        }
+    }
+
+    // Create image, MJPEG frames are decoded by the capture stage
+    const char *format = cfg->video_format;
     app->video_width = cfg->video_width;
     app->video_height = cfg->video_height;
+    if(strncmp(format, "MJPG", 4) == 0)
+    {
+        format = app->video_config.decode_yuv ? "YU12" : "RGB4";
+        if(app->capture) capture_get_size(app->capture, &app->video_width, &app->video_height);
+    }
+    if(!(app->image = graphics_image_create(app->graphics, app->video_width, app->video_height, format, ANCHOR_CENTER)))
+    {
+        ERROR("Cannot create image");
+        goto error;
+    }
+
+    // Upload only rows visible in the window
+    app->video_scale = (float)cfg->window_width / (float)cfg->window_height < (float)app->video_width / (float)app->video_height ?
+                       (float)cfg->window_height / (float)app->video_height : (float)cfg->window_width / (float)app->video_width;
+    if(ceilf(cfg->window_height / app->video_scale) < app->video_height)
+    {
+        graphics_image_set_crop(app->image, ceilf(cfg->window_height / app->video_scale));
+    }
+
+    // Copy arguments
     app->window_width = cfg->window_width;
     app->window_height = cfg->window_height;
     app->video_hfov = cfg->video_hfov;
     app->video_vfov = cfg->video_vfov;
     app->visible_distance = cfg->app_landmark_vis_dist;
     memcpy(app->label_color, cfg->graphics_font_color_2, 4);
+    app->event_loop = cfg->app_event_loop;
+    app->render_rate = cfg->app_render_rate;
+    app->frame_limit = cfg->app_frame_limit;
+    app->running = 1;
+
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) INFO("Initialized, peak RSS %ld kB", usage.ru_maxrss);
 
     return app;
 
 error:
+    if(app->capture) capture_stop(app->capture);
     if(app->video) video_close(app->video);
     if(app->gps) gps_free(app->gps);
     if(app->imu) imu_free(app->imu);
@@ -158,11 +265,25 @@ error:
     return NULL;
 }
 
-void application_mainloop(application_t *app)
+/* Reads next video frame, it is uploaded on next render */
+static int video_handler(application_t *app)
 {
-    DEBUG("application_mainloop()");
-    assert(app != 0);
+    PROFILE_BEGIN(VIDEO_READ);
+    int ok = video_read(app->video, &app->frame_data, &app->frame_length);
+    PROFILE_END(VIDEO_READ);
+    if(!ok)
+    {
+        ERROR("Cannot read from video device");
+        return 0;
+    }
+
+    app->frame_pending = true;
+    return 1;
+}
 
+/* Draws single frame */
+static int render(application_t *app)
+{
     void *data;
     size_t length;
     float att[3], alt, spd, trk, brg, dst;
@@ -170,72 +291,239 @@ void application_mainloop(application_t *app)
 
     float accsum[3];
     float difftime;
+    bool imported = false;
 
-    while(1)
+    PROFILE_BEGIN(FRAME);
+
+    if(app->video)
     {
-        // Process video
-        if(!video_read(app->video, &data, &length))
-        {
-            ERROR("Cannot read from video device");
-            break;
-        }
-        graphics_image_set_bitmap(app->image, data, length);
-        graphics_draw(app->graphics, app->image, app->window_width / 2, app->window_height / 2,
-                      (float)app->window_width / (float)app->window_height < (float)app->video_width / (float)app->video_height ?
-                      (float)app->window_height / (float)app->video_height : (float)app->window_width / (float)app->video_width, 0);
-
-        imu_get_attitude(app->imu, att);
-        gps_get_pos(app->gps, NULL, NULL, &alt);
-
-        imu_get_acceleration(app->imu, accsum, &difftime);
-        gps_inertial_update(app->gps, accsum[0], accsum[1], accsum[2], difftime);
-
-        // Draw landmarks
-        void *iterator;
-        float hangle, vangle, dist;
-        drawable_t *label = gps_get_projection_label(app->gps, &hangle, &vangle, &dist, att, &iterator);
-        while(iterator)
+        // Process video, import the buffer or fall back to upload
+        if(app->frame_pending)
         {
-            if((hangle > app->video_hfov / -2.0) &&
-               (hangle < app->video_hfov / 2.0)  &&
-               (vangle > app->video_vfov / -2.0) &&
-               (vangle < app->video_vfov / 2.0)  &&
-               (dist < app->visible_distance))
+            int fd;
+            uint32_t stride;
+            if(video_get_dmabuf(app->video, &fd, &stride) && graphics_image_set_dmabuf(app->image, fd, stride))
+            {
+                imported = true;
+            }
+            else
             {
-                INFO("Projecting landmark hangle = %f, vangle = %f, distance = %f", hangle, vangle, dist / 1000.0);
-                uint32_t x = (float)app->window_width  / 2 + (float)app->window_width  * hangle / app->video_hfov;
-                uint32_t y = (float)app->window_height / 2 + (float)app->window_height * vangle / app->video_vfov;
-                graphics_draw(app->graphics, label, x, y, 1, 0);
+                graphics_image_set_bitmap(app->image, app->frame_data, app->frame_length);
             }
-            label = gps_get_projection_label(app->gps, &hangle, &vangle, &dist, att, &iterator);
+            app->frame_pending = false;
+        }
+    }
+    else
+    {
+        // Process video, upload only when a new frame is available
+        int fresh = capture_get_frame(app->capture, &data, &length);
+        if(fresh < 0)
+        {
+            ERROR("Video capture stopped");
+            return 0;
         }
+        if(fresh) graphics_image_set_bitmap(app->image, data, length);
+    }
+    graphics_draw(app->graphics, app->image, app->window_width / 2, app->window_height / 2, app->video_scale, 0);
+
+    imu_get_attitude(app->imu, att);
+    gps_get_pos(app->gps, NULL, NULL, &alt);
+
+    imu_get_acceleration(app->imu, accsum, &difftime);
+    gps_inertial_update(app->gps, accsum[0], accsum[1], accsum[2], difftime);
+
+    // Draw landmarks
+    PROFILE_BEGIN(PROJECTION);
+    void *iterator;
+    float hangle, vangle, dist;
+    drawable_t *label = gps_get_projection_label(app->gps, &hangle, &vangle, &dist, att, &iterator);
+    while(iterator)
+    {
+        if((hangle > app->video_hfov / -2.0) &&
+           (hangle < app->video_hfov / 2.0)  &&
+           (vangle > app->video_vfov / -2.0) &&
+           (vangle < app->video_vfov / 2.0)  &&
+           (dist < app->visible_distance))
+        {
+            INFO("Projecting landmark hangle = %f, vangle = %f, distance = %f", hangle, vangle, dist / 1000.0);
+            uint32_t x = (float)app->window_width  / 2 + (float)app->window_width  * hangle / app->video_hfov;
+            uint32_t y = (float)app->window_height / 2 + (float)app->window_height * vangle / app->video_vfov;
+            // Distance field labels shrink with distance from the configured size down to half of it
+            float scale = app->label_sdf ? 1 - 0.5 * dist / app->visible_distance : 1;
+            graphics_draw(app->graphics, label, x, y, scale, 0);
+        }
+        label = gps_get_projection_label(app->gps, &hangle, &vangle, &dist, att, &iterator);
+    }
+    PROFILE_END(PROJECTION);
 
-        // Draw HUD overlay
-        gps_get_track(app->gps, &spd, &trk);
-        gps_get_route(app->gps, wpt, &dst, &brg);
-        graphics_hud_draw(app->hud, att, spd, alt, trk, brg, dst, wpt);
+    // Draw HUD overlay
+    gps_get_track(app->gps, &spd, &trk);
+    gps_get_route(app->gps, wpt, &dst, &brg);
+    graphics_hud_draw(app->hud, att, spd, alt, trk, brg, dst, wpt);
 
-        // Render to screen
-        if(!graphics_flush(app->graphics, NULL))
+    // Render to screen
+    if(!graphics_flush(app->graphics, NULL))
+    {
+        ERROR("Cannot draw");
+        return 0;
+    }
+
+    // Imported buffer is sampled until the next one is drawn
+    if(imported && !video_hold(app->video))
+    {
+        ERROR("Cannot hold video buffer");
+        return 0;
+    }
+
+    PROFILE_END(FRAME);
+    PROFILE_TICK();
+
+    if(app->start.tv_sec)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        INFO("Time to first frame %.1f ms", (now.tv_sec - app->start.tv_sec) * 1e3 + (now.tv_nsec - app->start.tv_nsec) / 1e6);
+        app->start.tv_sec = 0;
+    }
+
+    // Stop at frame limit
+    if(app->frame_limit && (++app->frames >= app->frame_limit))
+    {
+        INFO("Frame limit reached");
+        app->running = 0;
+    }
+
+    return 1;
+}
+
+/* Multiplexes all devices and render timer on single thread */
+static void event_loop(application_t *app)
+{
+    int epfd = -1, timer = -1;
+    int video_fd = app->video ? video_get_fd(app->video) : -1;
+    int gps_fd = gps_get_fd(app->gps);
+    int imu_fd = imu_get_fd(app->imu);
+
+    if(((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) || ((timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1))
+    {
+        ERROR("Cannot create event loop");
+        goto finalize;
+    }
+
+    // Arm render timer
+    long period = app->render_rate > 0 ? 1e9 / app->render_rate : 1e9 / 30;
+    struct itimerspec its;
+    its.it_interval.tv_sec = its.it_value.tv_sec = period / 1000000000;
+    its.it_interval.tv_nsec = its.it_value.tv_nsec = period % 1000000000;
+    if(timerfd_settime(timer, 0, &its, NULL) == -1)
+    {
+        ERROR("Cannot arm render timer");
+        goto finalize;
+    }
+
+    int fds[] = {timer, video_fd, gps_fd, imu_fd};
+    unsigned int i;
+    for(i = 0; i < sizeof(fds) / sizeof(*fds); i++)
+    {
+        if(fds[i] == -1) continue;
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1)
         {
-            ERROR("Cannot draw");
+            ERROR("Cannot add descriptor to event loop");
+            goto finalize;
+        }
+    }
+
+    INFO("Event loop started, rendering at %f fps", 1e9 / period);
+    while(app->running)
+    {
+        struct epoll_event events[4];
+        int num = epoll_wait(epfd, events, 4, -1);
+        if(num == -1)
+        {
+            if(errno == EINTR) continue;
+            ERROR("Cannot wait for events");
             break;
         }
+        app->wakeups++;
+
+        int n;
+        for(n = 0; n < num; n++)
+        {
+            int fd = events[n].data.fd;
+            if(fd == timer)
+            {
+                uint64_t expirations;
+                if(read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) continue;
+                if(!render(app)) goto finalize;
+            }
+            else if(fd == video_fd)
+            {
+                if(!video_handler(app)) goto finalize;
+            }
+            else if((fd == gps_fd) && !gps_process(app->gps))
+            {
+                ERROR("Broken pipe");
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            }
+            else if((fd == imu_fd) && !imu_process(app->imu))
+            {
+                ERROR("Broken pipe");
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            }
+        }
+    }
+
+finalize:
+    if(timer != -1) close(timer);
+    if(epfd != -1) close(epfd);
+}
+
+void application_mainloop(application_t *app)
+{
+    DEBUG("application_mainloop()");
+    assert(app != 0);
+
+    if(app->event_loop)
+    {
+        event_loop(app);
+    }
+    else while(app->running)
+    {
+        app->wakeups++;
+        if(app->video && !video_handler(app)) break;
+        if(!render(app)) break;
+    }
+
+    PROFILE_DUMP();
+
+    // Context switches are counted for all threads of the process
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        INFO("Main loop finished after %u wakeups, %ld voluntary and %ld involuntary context switches",
+             app->wakeups, usage.ru_nvcsw, usage.ru_nivcsw);
     }
 }
 
+void application_stop(application_t *app)
+{
+    app->running = 0;
+}
+
 void application_free(application_t *app)
 {
     DEBUG("application_free()");
     assert(app != 0);
 
-    video_close(app->video);
+    if(app->capture) capture_stop(app->capture);
+    if(app->video) video_close(app->video);
     gps_free(app->gps);
     imu_free(app->imu);
     graphics_drawable_free(app->image);
     graphics_hud_free(app->hud);
     graphics_atlas_free(app->atlas1);
-    graphics_atlas_free(app->atlas2);
+    if(app->atlas2) graphics_atlas_free(app->atlas2);
     graphics_free(app->graphics);
     free(app);
 }
@@ -23,9 +23,12 @@
 #define APPLICATION_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "imu-config.h"
 #include "gps-config.h"
+#include "video-config.h"
+#include "graphics-config.h"
 
 /**
  * @brief Application configuration structure
@@ -54,6 +57,23 @@ struct config
      */
     float app_landmark_vis_dist;
 
+    /**
+     * @brief Use single epoll event loop instead of worker threads
+     * @note Replayed video files are still read by the capture thread
+     */
+    bool app_event_loop;
+
+    /**
+     * @brief Render rate in event loop mode, frames per second
+     * @note Replaces graphics frame rate, which is ignored in event loop mode
+     */
+    float app_render_rate;
+
+    /**
+     * @brief Stop after rendering this many frames, 0 for no limit
+     */
+    uint32_t app_frame_limit;
+
 
     /************* VIDEO *************/
 
@@ -92,6 +112,12 @@ struct config
      */
     float video_vfov;
 
+    /**
+     * @brief Video configuration
+     * @note Enabling DMABUF export bypasses the capture thread
+     */
+    struct video_config video_conf;
+
 
     /************* GRAPHICS *************/
 
@@ -120,6 +146,22 @@ struct config
      */
     uint8_t graphics_font_size_2;
 
+    /**
+     * @brief Use one distance field atlas for both font sizes, landmark labels are scaled by distance
+     */
+    bool graphics_font_sdf;
+
+    /**
+     * @brief Directory of font atlas cache, NULL to rasterize glyphs at every start
+     */
+    char *graphics_atlas_cache;
+
+    /**
+     * @brief Graphics configuration
+     * @note Offscreen surface size is given by the window size
+     */
+    struct graphics_config graphics_conf;
+
 
     /************* IMU *************/
 
@@ -165,6 +207,13 @@ application_t *application_init(struct config *cfg);
  */
 void application_mainloop(application_t *app);
 
+/**
+ * @brief Requests main loop termination
+ * @param app Internal state as returned by `application_init()`
+ * @note This function is safe to call from signal handler
+ */
+void application_stop(application_t *app);
+
 /**
  * @brief Releases application resources
  * @param app Internal state as returned by `application_init()`
@@ -0,0 +1,473 @@
+/*
+ * Video capture stage
+ *
+ * Copyright (C) 2013 - Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at
+ * <http://www.gnu.org/licenses>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <turbojpeg.h>
+
+#include "debug.h"
+#include "profile.h"
+#include "capture.h"
+#include "video.h"
+
+/* Number of frame slots */
+#define SLOT_COUNT      3
+
+/* Maximum number of decoder threads */
+#define DECODER_MAX     8
+
+/* Shared slot index flag, set when the slot holds unread frame */
+#define SLOT_FRESH      0x04
+#define SLOT_INDEX      0x03
+
+struct decoder
+{
+    capture_t *capture;
+    pthread_t thread;
+    tjhandle jpeg;
+
+    // Compressed input and decoded output
+    void *input, *output;
+    size_t input_length, input_size;
+    struct video_frame_info info;
+
+    // Order of the assigned frame, set while the decoder is busy
+    uint32_t order;
+    bool pending;
+    pthread_cond_t cond;
+};
+
+struct _capture
+{
+    video_t *video;
+    tjhandle jpeg;
+    uint32_t width, height;
+    bool yuv;
+    pthread_t thread;
+
+    // Decoder pool, frames are assigned round robin and published in order
+    struct decoder decoders[DECODER_MAX];
+    int decoder_num;
+    uint32_t submitted, published;
+    pthread_mutex_t mutex;
+    pthread_cond_t turn;
+
+    // Frame slots
+    struct
+    {
+        void *data;
+        size_t length, size;
+        struct video_frame_info info;
+    }
+    slots[SLOT_COUNT];
+
+    // Slot owned by writer, by reader and the shared one
+    int back, front;
+    atomic_int middle;
+
+    // Statistics
+    atomic_uint produced, consumed, dropped;
+
+    // Set when the worker stops reading
+    atomic_bool stopped;
+};
+
+/* Finds the smallest JPEG scaled size covering the minimal size, returns 1 if it equals the minimal size exactly */
+static int scale(uint32_t width, uint32_t height, uint32_t min_width, uint32_t min_height, uint32_t *scaled_width, uint32_t *scaled_height)
+{
+    int i, num;
+    uint32_t w = width, h = height;
+    tjscalingfactor *factors = tjGetScalingFactors(&num);
+    for(i = 0; factors && (i < num); i++)
+    {
+        uint32_t sw = TJSCALED(width, factors[i]), sh = TJSCALED(height, factors[i]);
+        if((sw >= min_width) && (sh >= min_height) && (sw * sh < w * h))
+        {
+            w = sw;
+            h = sh;
+        }
+    }
+
+    if(scaled_width) *scaled_width = w;
+    if(scaled_height) *scaled_height = h;
+    return (w == min_width) && (h == min_height);
+}
+
+/* Decodes JPEG frame to RGBx or YUV planes, returns decoded length or 0 on error */
+static size_t decode(capture_t *capture, tjhandle jpeg, const void *data, size_t length, uint8_t *dst)
+{
+    if(!capture->yuv)
+    {
+        if(tjDecompress2(jpeg, data, length, dst, capture->width, capture->width * 4, capture->height,
+                         TJPF_RGBX, TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE) != 0) return 0;
+        return capture->width * capture->height * 4;
+    }
+
+    // Planes are kept in native subsampling
+    int width, height, subsamp, colorspace;
+    if((tjDecompressHeader3(jpeg, data, length, &width, &height, &subsamp, &colorspace) != 0) ||
+       !scale(width, height, capture->width, capture->height, NULL, NULL) ||
+       ((subsamp != TJSAMP_444) && (subsamp != TJSAMP_422) && (subsamp != TJSAMP_420))) return 0;
+
+    // Luma plane is decoded padded to whole MCUs
+    width = capture->width;
+    height = capture->height;
+    int luma_width = tjPlaneWidth(0, width, subsamp), luma_height = tjPlaneHeight(0, height, subsamp);
+    size_t chroma = tjPlaneWidth(1, width, subsamp) * tjPlaneHeight(1, height, subsamp);
+    uint8_t *planes[3] = { dst, dst + luma_width * luma_height, dst + luma_width * luma_height + chroma };
+    if(tjDecompressToYUVPlanes(jpeg, data, length, planes, width, NULL, height, TJFLAG_FASTDCT) != 0) return 0;
+
+    if((luma_width != width) || (luma_height != height))
+    {
+        // Drop the padding, planes are moved only towards the start
+        int row;
+        for(row = 1; row < height; row++) memmove(dst + row * width, dst + row * luma_width, width);
+        memmove(dst + width * height, planes[1], chroma * 2);
+    }
+    return width * height + chroma * 2;
+}
+
+/* Publishes back slot, takes over the shared one */
+static void publish(capture_t *capture)
+{
+    int prev = atomic_exchange_explicit(&capture->middle, capture->back | SLOT_FRESH, memory_order_acq_rel);
+    if(prev & SLOT_FRESH) atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&capture->produced, 1, memory_order_relaxed);
+    capture->back = prev & SLOT_INDEX;
+}
+
+/* Releases mutex of cancelled thread */
+static void unlock(void *arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)arg);
+}
+
+static void *decoder_worker(void *arg)
+{
+    struct decoder *decoder = (struct decoder*)arg;
+    capture_t *capture = decoder->capture;
+
+    pthread_mutex_lock(&capture->mutex);
+    pthread_cleanup_push(unlock, &capture->mutex);
+    while(1)
+    {
+        while(!decoder->pending) pthread_cond_wait(&decoder->cond, &capture->mutex);
+        pthread_mutex_unlock(&capture->mutex);
+
+        PROFILE_BEGIN(DECODE);
+        size_t length = decode(capture, decoder->jpeg, decoder->input, decoder->input_length, decoder->output);
+        PROFILE_END(DECODE);
+
+        // Wait for the previous frames to be published
+        pthread_mutex_lock(&capture->mutex);
+        while(capture->published != decoder->order) pthread_cond_wait(&capture->turn, &capture->mutex);
+
+        if(length)
+        {
+            // Swap decoded buffer into back slot
+            int back = capture->back;
+            void *tmp = capture->slots[back].data;
+            capture->slots[back].data = decoder->output;
+            capture->slots[back].length = length;
+            capture->slots[back].info = decoder->info;
+            decoder->output = tmp;
+            publish(capture);
+        }
+        else WARN("JPEG decompression failed");
+
+        capture->published++;
+        decoder->pending = false;
+        pthread_cond_broadcast(&capture->turn);
+        pthread_cond_broadcast(&decoder->cond);
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/* Passes compressed frame to the next decoder in order */
+static void submit(capture_t *capture, void *data, size_t length)
+{
+    struct decoder *decoder = &capture->decoders[capture->submitted % capture->decoder_num];
+
+    // Wait until the decoder is idle
+    pthread_mutex_lock(&capture->mutex);
+    pthread_cleanup_push(unlock, &capture->mutex);
+    while(decoder->pending) pthread_cond_wait(&decoder->cond, &capture->mutex);
+    pthread_cleanup_pop(1);
+
+    if(length > decoder->input_size)
+    {
+        decoder->input = realloc(decoder->input, length);
+        assert(decoder->input != 0);
+        decoder->input_size = length;
+    }
+    memcpy(decoder->input, data, length);
+    decoder->input_length = length;
+    video_get_frame_info(capture->video, &decoder->info);
+
+    pthread_mutex_lock(&capture->mutex);
+    decoder->order = capture->submitted++;
+    decoder->pending = true;
+    pthread_cond_broadcast(&decoder->cond);
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+static void *worker(void *arg)
+{
+    INFO("Thread started");
+    capture_t *capture = (capture_t*)arg;
+
+    void *data;
+    size_t length;
+    while(video_read(capture->video, &data, &length))
+    {
+        if(capture->decoder_num)
+        {
+            submit(capture, data, length);
+            continue;
+        }
+
+        int back = capture->back;
+        if(capture->jpeg)
+        {
+            // Decode to back slot
+            PROFILE_BEGIN(DECODE);
+            capture->slots[back].length = decode(capture, capture->jpeg, data, length, capture->slots[back].data);
+            PROFILE_END(DECODE);
+            if(!capture->slots[back].length)
+            {
+                WARN("JPEG decompression failed");
+                continue;
+            }
+        }
+        else
+        {
+            // Copy to back slot
+            if(length > capture->slots[back].size)
+            {
+                capture->slots[back].data = realloc(capture->slots[back].data, length);
+                assert(capture->slots[back].data != 0);
+                capture->slots[back].size = length;
+            }
+            memcpy(capture->slots[back].data, data, length);
+            capture->slots[back].length = length;
+        }
+
+        video_get_frame_info(capture->video, &capture->slots[back].info);
+        publish(capture);
+    }
+
+    ERROR("Cannot read from video device");
+
+    // Let decoders publish the submitted frames first
+    pthread_mutex_lock(&capture->mutex);
+    pthread_cleanup_push(unlock, &capture->mutex);
+    while(capture->published != capture->submitted) pthread_cond_wait(&capture->turn, &capture->mutex);
+    pthread_cleanup_pop(1);
+
+    atomic_store_explicit(&capture->stopped, true, memory_order_release);
+    return NULL;
+}
+
+/* Stops first `num` decoder threads and releases all decoders */
+static void decoders_stop(capture_t *capture, int num)
+{
+    int i;
+    for(i = 0; i < capture->decoder_num; i++)
+    {
+        struct decoder *decoder = &capture->decoders[i];
+        if(!decoder->jpeg) continue;
+        if(i < num)
+        {
+            pthread_cancel(decoder->thread);
+            pthread_join(decoder->thread, NULL);
+        }
+        pthread_cond_destroy(&decoder->cond);
+        tjDestroy(decoder->jpeg);
+        free(decoder->input);
+        free(decoder->output);
+    }
+    pthread_cond_destroy(&capture->turn);
+    pthread_mutex_destroy(&capture->mutex);
+}
+
+capture_t *capture_start(const char *device, uint32_t width, uint32_t height, const char format[4], bool interlace, const struct video_config *config)
+{
+    DEBUG("capture_start()");
+    assert(device != 0);
+    assert(format != 0);
+
+    capture_t *capture = calloc(1, sizeof(struct _capture));
+    assert(capture != 0);
+
+    capture->width = width;
+    capture->height = height;
+    capture->yuv = config->decode_yuv;
+    if(strncmp(format, "MJPG", 4) == 0)
+    {
+        // Decode directly at reduced size if it still covers the requested one
+        if(config->decode_width || config->decode_height)
+        {
+            scale(width, height, config->decode_width, config->decode_height, &capture->width, &capture->height);
+            INFO("Decoding scaled to %ux%u", capture->width, capture->height);
+        }
+
+        if(config->decoder_count > 1)
+        {
+            capture->decoder_num = config->decoder_count < DECODER_MAX ? config->decoder_count : DECODER_MAX;
+            INFO("Initializing %d JPEG decoders", capture->decoder_num);
+        }
+        else
+        {
+            INFO("Initializing JPEG decoder");
+            capture->jpeg = tjInitDecompress();
+            assert(capture->jpeg != 0);
+        }
+    }
+
+    int i;
+    for(i = 0; i < SLOT_COUNT; i++)
+    {
+        capture->slots[i].size = capture->width * capture->height * 4;
+        capture->slots[i].data = malloc(capture->slots[i].size);
+        assert(capture->slots[i].data != 0);
+    }
+    capture->back = 0;
+    capture->front = 1;
+    atomic_init(&capture->middle, 2);
+    atomic_init(&capture->stopped, false);
+
+    // Open video
+    if(!(capture->video = video_open(device, width, height, format, interlace, config)))
+    {
+        WARN("Failed to open video device");
+        goto error;
+    }
+
+    // Start decoder threads
+    pthread_mutex_init(&capture->mutex, NULL);
+    pthread_cond_init(&capture->turn, NULL);
+    for(i = 0; i < capture->decoder_num; i++)
+    {
+        struct decoder *decoder = &capture->decoders[i];
+        decoder->capture = capture;
+        decoder->jpeg = tjInitDecompress();
+        assert(decoder->jpeg != 0);
+        decoder->output = malloc(capture->width * capture->height * 4);
+        assert(decoder->output != 0);
+        pthread_cond_init(&decoder->cond, NULL);
+        if(pthread_create(&decoder->thread, NULL, decoder_worker, decoder))
+        {
+            WARN("Failed to create thread");
+            decoders_stop(capture, i);
+            video_close(capture->video);
+            goto error;
+        }
+    }
+
+    // Start worker thread
+    if(pthread_create(&capture->thread, NULL, worker, capture))
+    {
+        WARN("Failed to create thread");
+        decoders_stop(capture, capture->decoder_num);
+        video_close(capture->video);
+        goto error;
+    }
+
+    return capture;
+
+error:
+    for(i = 0; i < SLOT_COUNT; i++) free(capture->slots[i].data);
+    if(capture->jpeg) tjDestroy(capture->jpeg);
+    free(capture);
+    return NULL;
+}
+
+int capture_get_frame(capture_t *capture, void **data, size_t *length)
+{
+    DEBUG("capture_get_frame()");
+    assert(capture != 0);
+
+    // Frames published before the worker stopped are still returned
+    bool stopped = atomic_load_explicit(&capture->stopped, memory_order_acquire);
+
+    int fresh = stopped ? -1 : 0;
+    if(atomic_load_explicit(&capture->middle, memory_order_acquire) & SLOT_FRESH)
+    {
+        // Swap front slot with the shared one
+        int prev = atomic_exchange_explicit(&capture->middle, capture->front, memory_order_acq_rel);
+        atomic_fetch_add_explicit(&capture->consumed, 1, memory_order_relaxed);
+        capture->front = prev & SLOT_INDEX;
+        fresh = 1;
+    }
+
+    if(data) *data = capture->slots[capture->front].data;
+    if(length) *length = capture->slots[capture->front].length;
+    return fresh;
+}
+
+void capture_get_frame_info(capture_t *capture, struct video_frame_info *info)
+{
+    DEBUG("capture_get_frame_info()");
+    assert(capture != 0);
+    assert(info != 0);
+
+    *info = capture->slots[capture->front].info;
+}
+
+void capture_get_size(capture_t *capture, uint32_t *width, uint32_t *height)
+{
+    DEBUG("capture_get_size()");
+    assert(capture != 0);
+
+    if(width) *width = capture->width;
+    if(height) *height = capture->height;
+}
+
+void capture_get_stats(capture_t *capture, struct capture_stats *stats)
+{
+    DEBUG("capture_get_stats()");
+    assert(capture != 0);
+    assert(stats != 0);
+
+    stats->produced = atomic_load_explicit(&capture->produced, memory_order_relaxed);
+    stats->consumed = atomic_load_explicit(&capture->consumed, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&capture->dropped, memory_order_relaxed);
+}
+
+void capture_stop(capture_t *capture)
+{
+    DEBUG("capture_stop()");
+    assert(capture != 0);
+
+    pthread_cancel(capture->thread);
+    pthread_join(capture->thread, NULL);
+    decoders_stop(capture, capture->decoder_num);
+    video_close(capture->video);
+
+    INFO("Capture stopped, %u frames produced, %u consumed, %u dropped",
+         atomic_load(&capture->produced), atomic_load(&capture->consumed), atomic_load(&capture->dropped));
+
+    int i;
+    for(i = 0; i < SLOT_COUNT; i++) free(capture->slots[i].data);
+    if(capture->jpeg) tjDestroy(capture->jpeg);
+    free(capture);
+}
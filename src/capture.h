@@ -0,0 +1,138 @@
+/**
+ * @file
+ * @brief       Video capture stage
+ * @author      Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * @section LICENSE
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at
+ * <http://www.gnu.org/licenses>
+ *
+ * @section DESCRIPTION
+ * This is a capture stage which reads and decodes video frames on separate thread.
+ * Use `capture_start()` to open the video device and start the worker.
+ * Finished frames are published through a lock-free triple buffer,
+ * `capture_get_frame()` then always returns the newest one.
+ * MJPEG frames are decoded to RGBx, or to full range Y, U and V planes in their native subsampling
+ * if `decode_yuv` is configured (to be shown as "YU12" image), other formats are passed through unchanged.
+ * MJPEG frames may be decoded at reduced size, see `capture_get_size()`.
+ * With more than one decoder configured, consecutive MJPEG frames are decoded in parallel
+ * by a pool of decoder threads and published in the capture order.
+ * @note All functions except `capture_stop()` do not block
+ *
+ * Example:
+ * @code
+ * int main()
+ * {
+ *     struct video_config config = { .buffer_count = 4, .latest = true };
+ *     capture_t *capture = capture_start("/dev/video0", 800, 600, "MJPG", false, &config);
+ *     void *buffer;
+ *     size_t length;
+ *
+ *     while(1)
+ *     {
+ *         if(capture_get_frame(capture, &buffer, &length) > 0)
+ *         {
+ *             // TODO: Do some processing here
+ *         }
+ *     }
+ *
+ *     capture_stop(capture);
+ * }
+ * @endcode
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "video.h"
+
+/**
+ * @brief Internal object
+ */
+typedef struct _capture capture_t;
+
+/**
+ * @brief Capture statistics
+ */
+struct capture_stats
+{
+    /**
+     * @brief Frames published by the worker
+     */
+    uint32_t produced;
+
+    /**
+     * @brief Frames picked up by `capture_get_frame()`
+     */
+    uint32_t consumed;
+
+    /**
+     * @brief Frames overwritten before being picked up
+     */
+    uint32_t dropped;
+};
+
+/**
+ * @brief Opens video device and starts the capture thread
+ * @param device Device name eg. "/dev/video0"
+ * @param width Video frame width in pixels
+ * @param height Video frame height in pixels
+ * @param format Video format in fourcc notation eg. "MJPG"
+ * @param interlace Video interlacing (0 - disabled, 1 - enabled)
+ * @param config Pointer to video configuration structure
+ * @return Capture object or NULL on error
+ */
+capture_t *capture_start(const char *device, uint32_t width, uint32_t height, const char format[4], bool interlace, const struct video_config *config);
+
+/**
+ * @brief Gets the newest finished frame
+ * @param capture Object returned by `capture_start()`
+ * @param[out] data Pointer to pixel data buffer
+ * @param[out] length Pointer to data length
+ * @return 1 if a new frame was published since the last call, 0 otherwise, -1 if the video has ended or failed
+ * @note Each call to `capture_get_frame()` invalidates previous buffer, if there is no new frame the previous buffer is returned again.
+ */
+int capture_get_frame(capture_t *capture, void **data, size_t *length);
+
+/**
+ * @brief Gets capture timestamp and sequence number of the frame returned by last `capture_get_frame()`
+ * @param capture Object returned by `capture_start()`
+ * @param[out] info Frame information structure
+ */
+void capture_get_frame_info(capture_t *capture, struct video_frame_info *info);
+
+/**
+ * @brief Gets size of published frames
+ * @param capture Object returned by `capture_start()`
+ * @param[out] width Frame width in pixels
+ * @param[out] height Frame height in pixels
+ * @note MJPEG frames are scaled down to the smallest size covering `decode_width` and `decode_height` of the configuration
+ */
+void capture_get_size(capture_t *capture, uint32_t *width, uint32_t *height);
+
+/**
+ * @brief Gets frame statistics
+ * @param capture Object returned by `capture_start()`
+ * @param[out] stats Statistics structure
+ */
+void capture_get_stats(capture_t *capture, struct capture_stats *stats);
+
+/**
+ * @brief Stops the capture thread and frees all resources
+ * @param capture Object returned by `capture_start()`
+ */
+void capture_stop(capture_t *capture);
+
+#endif /* CAPTURE_H */
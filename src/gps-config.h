@@ -22,6 +22,8 @@
 #ifndef GPS_CONFIG_H
 #define GPS_CONFIG_H
 
+#include <stdbool.h>
+
 /**
  * @brief GPS configuration structure
  */
@@ -81,6 +83,11 @@ struct gps_config
      * @brief Callback function for synchronous deletion of drawable label
      */
     void(*delete_label)(void *label);
+
+    /**
+     * @brief Do not start the worker thread, `gps_process()` is called by the user when the descriptor is readable
+     */
+    bool polled;
 };
 
 #endif /* GPS_CONFIG_H */
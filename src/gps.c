@@ -25,6 +25,7 @@
 #include <termios.h>
 #include <math.h>
 #include <pthread.h>
+#include <errno.h>
 
 #include "debug.h"
 #include "gps.h"
@@ -50,6 +51,7 @@ struct _gps
     int fd;
     pthread_t thread;
     pthread_mutex_t mutex;
+    uint32_t reads;
     double latitude, longitude;
     float altitude, speed, track, bearing, distance;
     char waypoint[32];
@@ -110,166 +112,174 @@ static char** split_tokens(char *s)
     return NULL;
 }
 
-static void *worker(void *arg)
+int gps_process(gps_t *gps)
 {
-    INFO("Thread started");
-    gps_t *gps = (gps_t*)arg;
+    DEBUG("gps_process()");
+    assert(gps != 0);
 
     char buf[BUFFER_SIZE];
-    ssize_t len;
-    while((len = read(gps->fd, buf, BUFFER_SIZE - 1)) != -1)
+    ssize_t len = read(gps->fd, buf, BUFFER_SIZE - 1);
+    if(len == -1) return errno == EAGAIN;
+    if(len == 0) return 0;
+    buf[len] = 0;
+    gps->reads++;
+
+    char **tokens = split_tokens(buf);
+    if(tokens)
     {
-        if(len == 0) break;
-        buf[len] = 0;
+        double lat_deg, lat_min, lat_dir;
+        double lon_min, lon_deg, lon_dir;
+        float tmpf1, tmpf2;
 
-        char **tokens = split_tokens(buf);
-        if(tokens)
+        if(strcmp(tokens[0], "GPGGA") == 0)
         {
-            double lat_deg, lat_min, lat_dir;
-            double lon_min, lon_deg, lon_dir;
-            float tmpf1, tmpf2;
-
-            if(strcmp(tokens[0], "GPGGA") == 0)
+            INFO("Received GGA sentence");
+
+            // 1 - Fix time
+            // 2,3 - Latitude
+            if(sscanf(tokens[2], "%2lf%lf", &lat_deg, &lat_min) == 2)
+            if((lat_dir = *tokens[3] == 'N' ? 1 : *tokens[3] == 'S' ? -1 : 0) != 0)
+            // 4,5 - Longitude
+            if(sscanf(tokens[4], "%3lf%lf", &lon_deg, &lon_min) == 2)
+            if((lon_dir = *tokens[5] == 'E' ? 1 : *tokens[5] == 'W' ? -1 : 0) != 0)
+            // 6 - Fix quality
+            if(*tokens[6] == '1')
+            // 7 - Number of satellites
+            // 8 - Horizontal DOP
+            // 9,10 - Altitude AMSL
+            if(sscanf(tokens[9], "%f", &tmpf1) == 1)
+            if(*tokens[10] == 'M')
+            // 11,12 - Height of geoid above WGS84
+            // 13 - time in seconds since last DGPS update
+            // 14 - DGPS station ID number
             {
-                INFO("Received GGA sentence");
-
-                // 1 - Fix time
-                // 2,3 - Latitude
-                if(sscanf(tokens[2], "%2lf%lf", &lat_deg, &lat_min) == 2)
-                if((lat_dir = *tokens[3] == 'N' ? 1 : *tokens[3] == 'S' ? -1 : 0) != 0)
-                // 4,5 - Longitude
-                if(sscanf(tokens[4], "%3lf%lf", &lon_deg, &lon_min) == 2)
-                if((lon_dir = *tokens[5] == 'E' ? 1 : *tokens[5] == 'W' ? -1 : 0) != 0)
-                // 6 - Fix quality
-                if(*tokens[6] == '1')
-                // 7 - Number of satellites
-                // 8 - Horizontal DOP
-                // 9,10 - Altitude AMSL
-                if(sscanf(tokens[9], "%f", &tmpf1) == 1)
-                if(*tokens[10] == 'M')
-                // 11,12 - Height of geoid above WGS84
-                // 13 - time in seconds since last DGPS update
-                // 14 - DGPS station ID number
-                {
-                    pthread_mutex_lock(&gps->mutex);
-                    gps->latitude = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
-                    gps->longitude = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
-                    gps->altitude = tmpf1;
-                    pthread_mutex_unlock(&gps->mutex);
-                    continue;
-                }
-                goto error;
+                pthread_mutex_lock(&gps->mutex);
+                gps->latitude = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
+                gps->longitude = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
+                gps->altitude = tmpf1;
+                pthread_mutex_unlock(&gps->mutex);
+                return 1;
             }
+            goto error;
+        }
 
-            if(strcmp(tokens[0], "GPRMB") == 0)
+        if(strcmp(tokens[0], "GPRMB") == 0)
+        {
+            INFO("Received GPRMB sentence");
+
+            // 1 - Data status
+            if(*tokens[1] == 'A')
+            // 2,3 - Cross-track error
+            // 4 - Origin waypoint name
+            // 5 - Destination waypoint name
+            // 6,7 - Waypoint latitude
+            // 8,9 - Waypoint longitude
+            // 10 - Distance
+            if(sscanf(tokens[10], "%f", &tmpf1) == 1)
+            // 11 - Bearing
+            if(sscanf(tokens[11], "%f", &tmpf2) == 1)
+            // 12 - Velocity
+            // 13 - Arrival alarm
             {
-                INFO("Received GPRMB sentence");
-
-                // 1 - Data status
-                if(*tokens[1] == 'A')
-                // 2,3 - Cross-track error
-                // 4 - Origin waypoint name
-                // 5 - Destination waypoint name
-                // 6,7 - Waypoint latitude
-                // 8,9 - Waypoint longitude
-                // 10 - Distance
-                if(sscanf(tokens[10], "%f", &tmpf1) == 1)
-                // 11 - Bearing
-                if(sscanf(tokens[11], "%f", &tmpf2) == 1)
-                // 12 - Velocity
-                // 13 - Arrival alarm
-                {
-                    pthread_mutex_lock(&gps->mutex);
-                    strncpy(gps->waypoint, tokens[5], sizeof(gps->waypoint));
-                    gps->distance = tmpf1 * NM2KM;
-                    gps->bearing = tmpf2 / 180 * M_PI;
-                    pthread_mutex_unlock(&gps->mutex);
-                    continue;
-                }
-                goto error;
+                pthread_mutex_lock(&gps->mutex);
+                strncpy(gps->waypoint, tokens[5], sizeof(gps->waypoint));
+                gps->distance = tmpf1 * NM2KM;
+                gps->bearing = tmpf2 / 180 * M_PI;
+                pthread_mutex_unlock(&gps->mutex);
+                return 1;
             }
+            goto error;
+        }
 
-            if(strcmp(tokens[0], "GPRMC") == 0)
+        if(strcmp(tokens[0], "GPRMC") == 0)
+        {
+            INFO("Received GPRMC sentence");
+
+            // 1 - Fix time
+            // 2 - Status
+            if(*tokens[2] == 'A')
+            // 3,4 - Latitude
+            if(sscanf(tokens[3], "%2lf%lf", &lat_deg, &lat_min) == 2)
+            if((lat_dir = *tokens[4] == 'N' ? 1 : *tokens[4] == 'S' ? -1 : 0) != 0)
+            // 5,6 - Longitude
+            if(sscanf(tokens[5], "%3lf%lf", &lon_deg, &lon_min) == 2)
+            if((lon_dir = *tokens[6] == 'E' ? 1 : *tokens[6] == 'W' ? -1 : 0) != 0)
+            // 7 - Speed
+            if(sscanf(tokens[7], "%f", &tmpf1) == 1)
+            // 8 - Track angle
+            if(sscanf(tokens[8], "%f", &tmpf2) == 1)
+            // 9 - Date
+            // 10 - Magnetic variation
             {
-                INFO("Received GPRMC sentence");
-
-                // 1 - Fix time
-                // 2 - Status
-                if(*tokens[2] == 'A')
-                // 3,4 - Latitude
-                if(sscanf(tokens[3], "%2lf%lf", &lat_deg, &lat_min) == 2)
-                if((lat_dir = *tokens[4] == 'N' ? 1 : *tokens[4] == 'S' ? -1 : 0) != 0)
-                // 5,6 - Longitude
-                if(sscanf(tokens[5], "%3lf%lf", &lon_deg, &lon_min) == 2)
-                if((lon_dir = *tokens[6] == 'E' ? 1 : *tokens[6] == 'W' ? -1 : 0) != 0)
-                // 7 - Speed
-                if(sscanf(tokens[7], "%f", &tmpf1) == 1)
-                // 8 - Track angle
-                if(sscanf(tokens[8], "%f", &tmpf2) == 1)
-                // 9 - Date
-                // 10 - Magnetic variation
-                {
-                    pthread_mutex_lock(&gps->mutex);
-                    gps->latitude = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
-                    gps->longitude = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
-                    gps->speed = tmpf1 * NM2KM;
-                    gps->track = tmpf2 / 180 * M_PI;
-                    pthread_mutex_unlock(&gps->mutex);
-                    continue;
-                }
-                goto error;
+                pthread_mutex_lock(&gps->mutex);
+                gps->latitude = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
+                gps->longitude = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
+                gps->speed = tmpf1 * NM2KM;
+                gps->track = tmpf2 / 180 * M_PI;
+                pthread_mutex_unlock(&gps->mutex);
+                return 1;
             }
+            goto error;
+        }
 
-            if(strcmp(tokens[0], "GPWPL") == 0)
+        if(strcmp(tokens[0], "GPWPL") == 0)
+        {
+            INFO("Received GPWPL sentence");
+
+            // 1,2 - Latitude
+            if(sscanf(tokens[1], "%2lf%lf", &lat_deg, &lat_min) == 2)
+            if((lat_dir = *tokens[2] == 'N' ? 1 : *tokens[2] == 'S' ? -1 : 0) != 0)
+            // 3,4 - Longitude
+            if(sscanf(tokens[3], "%3lf%lf", &lon_deg, &lon_min) == 2)
+            if((lon_dir = *tokens[4] == 'E' ? 1 : *tokens[4] == 'W' ? -1 : 0) != 0)
+            // 5 - Waypoint name
             {
-                INFO("Received GPWPL sentence");
-
-                // 1,2 - Latitude
-                if(sscanf(tokens[1], "%2lf%lf", &lat_deg, &lat_min) == 2)
-                if((lat_dir = *tokens[2] == 'N' ? 1 : *tokens[2] == 'S' ? -1 : 0) != 0)
-                // 3,4 - Longitude
-                if(sscanf(tokens[3], "%3lf%lf", &lon_deg, &lon_min) == 2)
-                if((lon_dir = *tokens[4] == 'E' ? 1 : *tokens[4] == 'W' ? -1 : 0) != 0)
-                // 5 - Waypoint name
+                pthread_mutex_lock(&gps->mutex);
+                struct waypoint_node *node = gps->waypoint_list;
+                while(node)
                 {
-                    pthread_mutex_lock(&gps->mutex);
-                    struct waypoint_node *node = gps->waypoint_list;
-                    while(node)
+                    if(strcmp(node->name, tokens[5]) == 0)
                     {
-                        if(strcmp(node->name, tokens[5]) == 0)
-                        {
-                            // Update existing node
-                            node->lat = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
-                            node->lon = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
-                            node->alt = gps->dem ? gps_util_dem_get_alt(gps->dem, node->lat, node->lon) : node->alt;
-                            goto finish_wpl;
-                        }
-                        node = node->next;
+                        // Update existing node
+                        node->lat = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
+                        node->lon = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
+                        node->alt = gps->dem ? gps_util_dem_get_alt(gps->dem, node->lat, node->lon) : node->alt;
+                        goto finish_wpl;
                     }
+                    node = node->next;
+                }
 
-                    // Create new node
-                    node = malloc(sizeof(struct waypoint_node));
-                    node->lat = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
-                    node->lon = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
-                    node->alt = gps->dem ? gps_util_dem_get_alt(gps->dem, node->lat, node->lon) : 0;
-                    node->label = NULL;
-                    strncpy(node->name, tokens[5], sizeof(node->name));
-                    node->next = gps->waypoint_list;
-                    gps->waypoint_list = node;
+                // Create new node
+                node = malloc(sizeof(struct waypoint_node));
+                node->lat = lat_dir * (lat_deg + lat_min / 60.0) / 180.0 * M_PI;
+                node->lon = lon_dir * (lon_deg + lon_min / 60.0) / 180.0 * M_PI;
+                node->alt = gps->dem ? gps_util_dem_get_alt(gps->dem, node->lat, node->lon) : 0;
+                node->label = NULL;
+                strncpy(node->name, tokens[5], sizeof(node->name));
+                node->next = gps->waypoint_list;
+                gps->waypoint_list = node;
 
 finish_wpl:
-                    pthread_mutex_unlock(&gps->mutex);
-                    continue;
-                }
-
-                goto error;
+                pthread_mutex_unlock(&gps->mutex);
+                return 1;
             }
 
-            WARN("Unknown sentence: `%s`", tokens[0]);
+            goto error;
         }
-error:
-        WARN("Parse error");
+
+        WARN("Unknown sentence: `%s`", tokens[0]);
     }
+error:
+    WARN("Parse error");
+    return 1;
+}
+
+static void *worker(void *arg)
+{
+    INFO("Thread started");
+    gps_t *gps = (gps_t*)arg;
+
+    while(gps_process(gps));
 
     ERROR("Broken pipe");
     return NULL;
@@ -305,7 +315,7 @@ gps_t *gps_init(const char *device, const struct gps_config *config)
     assert(gps != 0);
 
     // Open device
-    if((gps->fd = open(device, O_RDONLY | O_NOCTTY)) == -1)
+    if((gps->fd = open(device, O_RDONLY | O_NOCTTY | (config->polled ? O_NONBLOCK : 0))) == -1)
     {
         WARN("Failed to open '%s'", device);
         free(gps);
@@ -333,7 +343,7 @@ gps_t *gps_init(const char *device, const struct gps_config *config)
     if(config->datafile) gps->waypoint_list = gps_util_load_datafile(config->datafile, gps->dem);
 
     // Start worker thread
-    if(pthread_mutex_init(&gps->mutex, NULL) || pthread_create(&gps->thread, NULL, worker, gps))
+    if(pthread_mutex_init(&gps->mutex, NULL) || (!config->polled && pthread_create(&gps->thread, NULL, worker, gps)))
     {
         WARN("Failed to create thread");
         gps_internal_free(gps);
@@ -343,6 +353,14 @@ gps_t *gps_init(const char *device, const struct gps_config *config)
     return gps;
 }
 
+int gps_get_fd(gps_t *gps)
+{
+    DEBUG("gps_get_fd()");
+    assert(gps != 0);
+
+    return gps->fd;
+}
+
 void gps_get_pos(gps_t *gps, double *lat, double *lon, float *alt)
 {
     DEBUG("gps_get_pos()");
@@ -445,8 +463,12 @@ void gps_free(gps_t *gps)
     DEBUG("gps_free()");
     assert(gps != 0);
 
-    pthread_cancel(gps->thread);
-    pthread_join(gps->thread, NULL);
+    if(!gps->config->polled)
+    {
+        pthread_cancel(gps->thread);
+        pthread_join(gps->thread, NULL);
+    }
+    INFO("Processed %u reads", gps->reads);
     pthread_mutex_destroy(&gps->mutex);
     gps_internal_free(gps);
 }
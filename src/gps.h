@@ -18,6 +18,8 @@
  * @section DESCRIPTION
  * This is a utility library for GPS devices using NMEA 0183 protocol.
  * It works over serial tty line initializes by `gps_init()`, processing is done in separate thread.
+ * If `polled` is set in the configuration, no thread is started and `gps_process()` should be called
+ * whenever the descriptor returned by `gps_get_fd()` becomes readable.
  * @note All functions do not block
  *
  * Example:
@@ -60,6 +62,21 @@ typedef struct _gps gps_t;
  */
 gps_t *gps_init(const char *device, const struct gps_config *config);
 
+/**
+ * @brief Gets device file descriptor
+ * @param gps Object returned by `gps_init()`
+ * @return File descriptor, opened as non-blocking in polled mode
+ */
+int gps_get_fd(gps_t *gps);
+
+/**
+ * @brief Reads and parses pending data from the device
+ * @param gps Object returned by `gps_init()`
+ * @return 1 on success or if no data is pending, 0 on end of stream or error
+ * @note Used in polled mode only, the worker thread calls this in a loop otherwise
+ */
+int gps_process(gps_t *gps);
+
 /**
  * @brief Gets position information
  * @param gps Object returned by `gps_init()`
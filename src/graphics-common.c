@@ -17,96 +17,260 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include <turbojpeg.h>
 
 #include "debug.h"
+#include "profile.h"
 #include "graphics.h"
 
 #define GRAPHICS_PRIV_H
 #include "graphics-priv.h"
 
+/* Maximum number of imported DMABUF buffers */
+#define IMPORT_MAX      32
+
+/* Number of streamed image textures, GPU may still read one while the next is uploaded */
+#define TEXTURE_RING    3
+
+/* Number of preallocated decode buffers */
+#define DECODE_BUFFERS  2
+
+/* DRM fourcc code for RGBx byte order */
+#define DRM_FORMAT_XBGR8888     0x34324258
+
 struct _drawable_image
 {
     struct _drawable d;
-    GLuint width, height;
-    enum { FORMAT_RGBA, FORMAT_MJPEG } format;
+    enum anchor_types anchor;
+    enum { FORMAT_RGBA, FORMAT_YUYV, FORMAT_NV12, FORMAT_I420 } format;
+
+    // JPEG decoder of MJPEG images, frames are decoded to RGBx or YU12 format
     union { tjhandle jpeg; } decoder;
+
+    // Texture size, source frame height and its first visible row
+    GLuint width, height, frame_height, top;
+
+    // Page aligned decode buffers reused across frames
+    uint8_t *decode[DECODE_BUFFERS];
+    int decode_index;
+
+    // Streamed textures, additional planes and pixel unpack buffers
+    struct
+    {
+        GLuint tex, planes[2], pbo;
+        GLsizeiptr pbo_size;
+        GLsizei chroma_width, chroma_height;
+    }
+    ring[TEXTURE_RING];
+    int current;
+
+    // Imported DMABUF buffers
+    struct
+    {
+        int fd;
+        EGLImageKHR image;
+        GLuint tex;
+    }
+    imports[IMPORT_MAX];
+    int import_num;
+
+    // Import was rejected, frames are uploaded until the storage is recreated
+    int import_failed;
 };
 
-void graphics_draw(graphics_t *g, drawable_t *d, int x, int y, float scale, float rotation)
+/* Visible part of image plane, rows are contiguous */
+struct plane
 {
-    DEBUG("graphics_draw()");
-    assert(g != 0);
-    assert(d != 0);
+    GLuint tex;
+    GLenum format;
+    GLsizei width, height;
+    const GLubyte *data;
+    size_t size;
+};
 
-    if(d->num == 0) return;
+/* Creates texture with allocated storage */
+static GLuint texture_create(graphics_t *g, GLenum format, GLsizei width, GLsizei height, GLint filter)
+{
+    GLuint tex;
+    glGenTextures(1, &tex);
+    state_bind_texture(g, 0, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    return tex;
+}
 
-    // Set position, scale and rotation
-    glUniform2f(g->uni_offset, (GLfloat)x * 2.0 / (GLfloat)g->width - 1.0, (GLfloat)y * -2.0 / (GLfloat)g->height + 1.0);
-    glUniform2f(g->uni_scale, scale, scale);
-    glUniform1f(g->uni_rot, rotation);
+/* Size of uploaded frame in bytes */
+static size_t frame_size(int format, GLuint width, GLuint height)
+{
+    switch(format)
+    {
+        case FORMAT_YUYV:
+            return width * height * 2;
 
-    // Set colors
-    glUniform4fv(g->uni_mask, 1, d->mask);
-    glUniform4fv(g->uni_color, 1, d->color);
+        case FORMAT_NV12:
+        case FORMAT_I420:
+            return width * height * 3 / 2;
 
-    // Bind the texture
-    glBindTexture(GL_TEXTURE_2D, d->tex);
-    glUniform1i(g->uni_tex, 0);
+        case FORMAT_RGBA:
+        default:
+            return width * height * 4;
+    }
+}
 
-    // Bind the vertex buffer
-    glBindBuffer(GL_ARRAY_BUFFER, d->vbo);
-    glVertexAttribPointer(g->attr_coord, 4, GL_FLOAT, GL_FALSE, 0, 0);
+/* Gets chroma plane size of planar frame from its length */
+static int planar_chroma(struct _drawable_image *image, uint32_t len, GLsizei *width, GLsizei *height)
+{
+    uint32_t luma = image->width * image->frame_height;
+    uint32_t half_width = (image->width + 1) / 2;
+    uint32_t half_height = (image->frame_height + 1) / 2;
 
-    // Draw arrays
-    glDrawArrays(d->mode, 0, d->num);
+    if(len >= luma * 3)
+    {
+        // 4:4:4
+        *width = image->width;
+        *height = image->frame_height;
+    }
+    else if(len >= luma + half_width * image->frame_height * 2)
+    {
+        // 4:2:2
+        *width = half_width;
+        *height = image->frame_height;
+    }
+    else if(len >= luma + half_width * half_height * 2)
+    {
+        // 4:2:0
+        *width = half_width;
+        *height = half_height;
+    }
+    else return 0;
+
+    return 1;
 }
 
-drawable_t *graphics_image_create(graphics_t *g, uint32_t width, uint32_t height, const char format[4], enum anchor_types anchor)
+/* Checks that JPEG frame can be decoded to exactly the given size */
+static int jpeg_scalable(int width, int height, int scaled_width, int scaled_height)
 {
-    DEBUG("graphics_image_create()");
-    assert(g != 0);
+    int i, num;
+    tjscalingfactor *factors = tjGetScalingFactors(&num);
+    for(i = 0; factors && (i < num); i++)
+    {
+        if((TJSCALED(width, factors[i]) == scaled_width) && (TJSCALED(height, factors[i]) == scaled_height)) return 1;
+    }
 
-    struct _drawable_image *image = malloc(sizeof(struct _drawable_image));
-    assert(image != 0);
+    return 0;
+}
 
-    if(strcmp(format, "RGB4") == 0)
+/* Decodes JPEG frame to RGBx, returns decoded length or 0 on error */
+static uint32_t jpeg_decode_rgbx(tjhandle jpeg, const void *data, uint32_t length, uint8_t *dst, int width, int height)
+{
+    if(tjDecompress2(jpeg, data, length, dst, width, width * 4, height, TJPF_RGBX, TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE) != 0) return 0;
+    return width * height * 4;
+}
+
+/* Decodes JPEG frame to packed Y, U and V planes, returns decoded length or 0 on error */
+static uint32_t jpeg_decode_planes(tjhandle jpeg, const void *data, uint32_t length, uint8_t *dst, int width, int height, int subsamp)
+{
+    // Luma plane is decoded padded to whole MCUs
+    int luma_width = tjPlaneWidth(0, width, subsamp), luma_height = tjPlaneHeight(0, height, subsamp);
+    uint32_t chroma = tjPlaneWidth(1, width, subsamp) * tjPlaneHeight(1, height, subsamp);
+    uint8_t *planes[3] = { dst, dst + luma_width * luma_height, dst + luma_width * luma_height + chroma };
+    if(tjDecompressToYUVPlanes(jpeg, data, length, planes, width, NULL, height, TJFLAG_FASTDCT) != 0) return 0;
+
+    if((luma_width != width) || (luma_height != height))
     {
-        image->format = FORMAT_RGBA;
+        // Drop the padding, planes are moved only towards the start
+        int row;
+        for(row = 1; row < height; row++) memmove(dst + row * width, dst + row * luma_width, width);
+        memmove(dst + width * height, planes[1], chroma * 2);
     }
-    else if(strcmp(format, "MJPG") == 0)
+    return width * height + chroma * 2;
+}
+
+/* Allocates texture storage for the visible part of frame, frames are then streamed into it */
+static void image_storage_create(struct _drawable_image *image)
+{
+    int i;
+    for(i = 0; i < TEXTURE_RING; i++)
     {
-        INFO("Initializing JPEG decoder");
-        image->format = FORMAT_MJPEG;
-        image->decoder.jpeg = tjInitDecompress();
-        assert(image->decoder.jpeg != 0);
+        switch(image->format)
+        {
+            case FORMAT_YUYV:
+                // Luminance holds Y, alpha holds alternating U and V
+                image->ring[i].tex = texture_create(image->d.g, GL_LUMINANCE_ALPHA, image->width, image->height, GL_NEAREST);
+                break;
+
+            case FORMAT_NV12:
+                // Full size Y plane, half size interleaved UV plane filtered for upsampling
+                image->ring[i].tex = texture_create(image->d.g, GL_LUMINANCE, image->width, image->height, GL_NEAREST);
+                image->ring[i].planes[0] = texture_create(image->d.g, GL_LUMINANCE_ALPHA, image->width / 2, image->height / 2, GL_LINEAR);
+                break;
+
+            case FORMAT_I420:
+                // Separate luminance textures for Y, U and V planes, chroma is resized to match subsampling
+                image->ring[i].chroma_width = (image->width + 1) / 2;
+                image->ring[i].chroma_height = (image->height + 1) / 2;
+                image->ring[i].tex = texture_create(image->d.g, GL_LUMINANCE, image->width, image->height, GL_NEAREST);
+                image->ring[i].planes[0] = texture_create(image->d.g, GL_LUMINANCE, image->ring[i].chroma_width, image->ring[i].chroma_height, GL_LINEAR);
+                image->ring[i].planes[1] = texture_create(image->d.g, GL_LUMINANCE, image->ring[i].chroma_width, image->ring[i].chroma_height, GL_LINEAR);
+                break;
+
+            case FORMAT_RGBA:
+            default:
+                image->ring[i].tex = texture_create(image->d.g, GL_RGBA, image->width, image->height, GL_NEAREST);
+                break;
+        }
+
+        if(image->d.g->unpack_buffer)
+        {
+            glGenBuffers(1, &image->ring[i].pbo);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, image->ring[i].pbo);
+            image->ring[i].pbo_size = frame_size(image->format, image->width, image->height);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, image->ring[i].pbo_size, NULL, GL_STREAM_DRAW);
+        }
     }
-    else
+    if(image->d.g->unpack_buffer) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    image->current = 0;
+    image->d.tex = image->ring[0].tex;
+}
+
+/* Releases texture storage and imported buffers */
+static void image_storage_free(struct _drawable_image *image)
+{
+    int i;
+    for(i = 0; i < image->import_num; i++)
     {
-        WARN("No convertor for `%4c` format", format);
-        free(image);
-        return NULL;
+        state_delete_textures(image->d.g, 1, &image->imports[i].tex);
+        image->d.g->destroy_image(image->d.g->display, image->imports[i].image);
     }
+    image->import_num = 0;
+    image->import_failed = 0;
 
-    image->d.type = DRAWABLE_IMAGE;
-    image->d.mask[0] = 1;
-    image->d.mask[1] = 1;
-    image->d.mask[2] = 1;
-    image->d.mask[3] = 0;
-    image->d.color[0] = 0;
-    image->d.color[1] = 0;
-    image->d.color[2] = 0;
-    image->d.color[3] = 1;
-    image->d.num = 6;
-    image->d.mode = GL_TRIANGLES;
+    for(i = 0; i < TEXTURE_RING; i++)
+    {
+        state_delete_textures(image->d.g, 1, &image->ring[i].tex);
+        state_delete_textures(image->d.g, 2, image->ring[i].planes);
+        if(image->ring[i].pbo) glDeleteBuffers(1, &image->ring[i].pbo);
+    }
+    memset(image->ring, 0, sizeof(image->ring));
+}
 
-    float right = 2.0 / g->width * width;
-    float bottom = 2.0 / g->height * height;
+/* Calculates verticies of the visible part of frame */
+static void image_geometry(struct _drawable_image *image)
+{
+    graphics_t *g = image->d.g;
+    float right = 2.0 / g->width * image->width;
+    float bottom = 2.0 / g->height * image->height;
     float offset_x = 0;
     float offset_y = 0;
-    switch(anchor)
+    switch(image->anchor)
     {
         case ANCHOR_LEFT_BOTTOM:
             offset_y = (float)bottom;
@@ -151,16 +315,328 @@ drawable_t *graphics_image_create(graphics_t *g, uint32_t width, uint32_t height
     };
 
     // Buffer data
-    glGenTextures(1, &(image->d.tex));
-    glGenBuffers(1, &(image->d.vbo));
-    glBindBuffer(GL_ARRAY_BUFFER, image->d.vbo);
+    state_bind_buffer(image->d.g, image->d.vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_DYNAMIC_DRAW);
+}
+
+void drawable_reserve(struct _drawable *d, GLuint num)
+{
+    if(num > d->capacity)
+    {
+        d->vertices = realloc(d->vertices, num * 4 * sizeof(GLfloat));
+        assert(d->vertices != 0);
+        d->capacity = num;
+    }
+}
+
+void drawable_set_vertices(struct _drawable *d, const GLfloat *array, GLuint num)
+{
+    drawable_reserve(d, num);
+    memcpy(d->vertices, array, num * 4 * sizeof(GLfloat));
+    d->num = num;
+}
+
+void batch_add(graphics_t *g, struct _drawable *d, GLuint first, GLuint count, int x, int y, float scale, float rotation)
+{
+    assert(first + count <= d->num);
+    assert(((d->mode != GL_LINE_STRIP) && (d->mode != GL_LINE_LOOP)) || ((first == 0) && (count == d->num)));
+    if(count == 0) return;
+
+    // Strips and loops are batched as separate line segments
+    GLuint i, num = count;
+    GLenum mode = GL_LINES;
+    switch(d->mode)
+    {
+        case GL_TRIANGLES:
+            mode = GL_TRIANGLES;
+            break;
+
+        case GL_LINE_STRIP:
+            num = 2 * (d->num - 1);
+            break;
+
+        case GL_LINE_LOOP:
+            num = 2 * d->num;
+            break;
+    }
+
+    // Grow the draw list
+    if(g->batch_num == g->batch_max)
+    {
+        g->batch_max = g->batch_max ? g->batch_max * 2 : 64;
+        g->batches = realloc(g->batches, g->batch_max * sizeof(struct batch));
+        assert(g->batches != 0);
+    }
+    if(g->vertex_num + num > g->vertex_max)
+    {
+        while(g->vertex_num + num > g->vertex_max) g->vertex_max = g->vertex_max ? g->vertex_max * 2 : 1024;
+        g->vertices = realloc(g->vertices, g->vertex_max * BATCH_STRIDE * sizeof(GLfloat));
+        g->sorted = realloc(g->sorted, g->vertex_max * BATCH_STRIDE * sizeof(GLfloat));
+        assert((g->vertices != 0) && (g->sorted != 0));
+    }
+
+    // Texture is not sampled with zero mask, such drawables share any texture
+    struct batch *batch = &g->batches[g->batch_num];
+    batch->tex = (d->mask[0] || d->mask[1] || d->mask[2] || d->mask[3]) ? d->tex : 0;
+    batch->mode = mode;
+    batch->sdf = d->smoothing > 0;
+    batch->first = g->vertex_num;
+    batch->count = num;
+    batch->order = g->batch_num++;
+    batch->tex_height = (d->type == DRAWABLE_LABEL) ? label_texture_height(d) : NULL;
+    batch->height = batch->tex_height ? *batch->tex_height : 0;
+
+    // Bake position, scale and rotation into vertices
+    GLfloat offset_x = (GLfloat)x * 2.0 / (GLfloat)g->width - 1.0;
+    GLfloat offset_y = (GLfloat)y * -2.0 / (GLfloat)g->height + 1.0;
+    GLfloat sinrot = sinf(rotation);
+    GLfloat cosrot = cosf(rotation);
+    GLfloat *dst = g->vertices + g->vertex_num * BATCH_STRIDE;
+    for(i = 0; i < num; i++, dst += BATCH_STRIDE)
+    {
+        GLuint index = i;
+        if(d->mode == GL_LINE_STRIP) index = (i + 1) / 2;
+        else if(d->mode == GL_LINE_LOOP) index = ((i + 1) / 2) % d->num;
+
+        const GLfloat *src = d->vertices + (first + index) * 4;
+        dst[0] = (src[0] * cosrot - src[1] * sinrot) * scale + offset_x;
+        dst[1] = (src[0] * sinrot + src[1] * cosrot) * scale + offset_y;
+        dst[2] = src[2];
+        dst[3] = src[3];
+        memcpy(dst + 4, d->color, 4 * sizeof(GLfloat));
+        memcpy(dst + 8, d->mask, 4 * sizeof(GLfloat));
+        if(batch->sdf) dst[7] = d->smoothing / scale;
+    }
+    g->vertex_num += num;
+}
+
+static int batch_compare(const void *a, const void *b)
+{
+    const struct batch *x = a, *y = b;
+
+    if(x->sdf != y->sdf) return x->sdf < y->sdf ? -1 : 1;
+    if(x->mode != y->mode) return x->mode < y->mode ? -1 : 1;
+    if(x->tex != y->tex) return x->tex < y->tex ? -1 : 1;
+    return x->order < y->order ? -1 : 1;
+}
+
+void batch_flush(graphics_t *g)
+{
+    if(g->batch_num == 0) return;
+
+    // Sort by program, drawing mode and texture, keep submission order otherwise
+    qsort(g->batches, g->batch_num, sizeof(struct batch), batch_compare);
+
+    // Gather vertices in drawing order
+    GLuint i, j, num = 0;
+    for(i = 0; i < g->batch_num; i++)
+    {
+        struct batch *batch = &g->batches[i];
+        memcpy(g->sorted + num * BATCH_STRIDE, g->vertices + batch->first * BATCH_STRIDE, batch->count * BATCH_STRIDE * sizeof(GLfloat));
+
+        // Atlas grew by a label laid out later in the frame, only the height changes
+        if(batch->tex_height && (*batch->tex_height != batch->height))
+        {
+            GLfloat ratio = (GLfloat)batch->height / (GLfloat)*batch->tex_height;
+            for(j = 0; j < batch->count; j++) g->sorted[(num + j) * BATCH_STRIDE + 3] *= ratio;
+        }
+        batch->first = num;
+        num += batch->count;
+    }
+
+    // Stream vertices, buffer storage is reallocated only to grow
+    state_bind_buffer(g, g->batch_vbo);
+    if(num > g->batch_capacity)
+    {
+        g->batch_capacity = g->vertex_max;
+        glBufferData(GL_ARRAY_BUFFER, g->batch_capacity * BATCH_STRIDE * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, 0, num * BATCH_STRIDE * sizeof(GLfloat), g->sorted);
+    g->frame_bytes += num * BATCH_STRIDE * sizeof(GLfloat);
+    state_attrib_pointer(g, BATCH_STRIDE);
+
+    // Draw each run of equal program, mode and texture at once
+    for(i = 0; i < g->batch_num; i = j)
+    {
+        for(j = i + 1; (j < g->batch_num) && (g->batches[j].sdf == g->batches[i].sdf) &&
+            (g->batches[j].mode == g->batches[i].mode) && (g->batches[j].tex == g->batches[i].tex); j++);
+
+        state_use_program(g, g->batches[i].sdf ? g->sdf_prog : g->batch_prog);
+        state_bind_texture(g, 0, g->batches[i].tex);
+        glDrawArrays(g->batches[i].mode, g->batches[i].first, g->batches[j - 1].first + g->batches[j - 1].count - g->batches[i].first);
+        g->draw_calls++;
+    }
+
+    g->batch_num = 0;
+    g->vertex_num = 0;
+}
+
+void graphics_draw(graphics_t *g, drawable_t *d, int x, int y, float scale, float rotation)
+{
+    DEBUG("graphics_draw()");
+    assert(g != 0);
+    assert(d != 0);
+
+    if(d->type == DRAWABLE_LABEL) label_revalidate(d);
+    if(d->num == 0) return;
+    g->stats.draws++;
+
+    // Collect labels and HUD elements to the draw list
+    if((d->type == DRAWABLE_BASE) || (d->type == DRAWABLE_LABEL))
+    {
+        batch_add(g, d, 0, d->num, x, y, scale, rotation);
+        return;
+    }
+
+    // Draw pending list first to keep the drawing order
+    batch_flush(g);
+
+    // Select shader program
+    struct shader *shader = &g->shaders[d->shader];
+    state_use_program(g, shader->prog);
+
+    // Set position, scale and rotation
+    GLfloat offset[2] = { (GLfloat)x * 2.0 / (GLfloat)g->width - 1.0, (GLfloat)y * -2.0 / (GLfloat)g->height + 1.0 };
+    GLfloat scales[2] = { scale, scale };
+    state_uniform(g, shader->uni_offset, shader->offset, offset, 2);
+    state_uniform(g, shader->uni_scale, shader->scale, scales, 2);
+    state_uniform(g, shader->uni_rot, shader->rot, &rotation, 1);
+
+    // Set colors
+    state_uniform(g, shader->uni_mask, shader->mask, d->mask, 4);
+    state_uniform(g, shader->uni_color, shader->color, d->color, 4);
+
+    if(d->type == DRAWABLE_IMAGE)
+    {
+        // Bind additional planes
+        struct _drawable_image *image = (struct _drawable_image*)d;
+        if(image->format == FORMAT_NV12)
+        {
+            state_bind_texture(g, 1, image->ring[image->current].planes[0]);
+        }
+        else if(image->format == FORMAT_I420)
+        {
+            state_bind_texture(g, 1, image->ring[image->current].planes[0]);
+            state_bind_texture(g, 2, image->ring[image->current].planes[1]);
+        }
+        GLfloat texsize[2] = { image->width, image->height };
+        state_uniform(g, shader->uni_texsize, shader->texsize, texsize, 2);
+    }
+
+    // Bind the texture
+    state_bind_texture(g, 0, d->tex);
+
+    // Bind the vertex buffer
+    state_bind_buffer(g, d->vbo);
+    state_attrib_pointer(g, 4);
+
+    // Draw arrays, layers are already multiplied by alpha
+    if(d->type == DRAWABLE_LAYER) glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDrawArrays(d->mode, 0, d->num);
+    if(d->type == DRAWABLE_LAYER) glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    g->draw_calls++;
+}
+
+drawable_t *graphics_image_create(graphics_t *g, uint32_t width, uint32_t height, const char format[4], enum anchor_types anchor)
+{
+    DEBUG("graphics_image_create()");
+    assert(g != 0);
+
+    struct _drawable_image *image = calloc(1, sizeof(struct _drawable_image));
+    assert(image != 0);
+
+    if(strncmp(format, "RGB4", 4) == 0)
+    {
+        image->format = FORMAT_RGBA;
+        image->d.shader = SHADER_RGBA;
+    }
+    else if(strncmp(format, "MJPG", 4) == 0)
+    {
+        // Decode to planes converted by shader or to RGBx
+        INFO("Initializing JPEG decoder");
+        image->format = g->config.decode_yuv ? FORMAT_I420 : FORMAT_RGBA;
+        image->d.shader = g->config.decode_yuv ? SHADER_I420 : SHADER_RGBA;
+        image->decoder.jpeg = tjInitDecompress();
+        assert(image->decoder.jpeg != 0);
+
+        int i;
+        for(i = 0; i < DECODE_BUFFERS; i++)
+        {
+            if(posix_memalign((void**)&image->decode[i], sysconf(_SC_PAGESIZE), width * height * 4))
+            {
+                WARN("Failed to allocate decode buffer");
+                while(--i >= 0) free(image->decode[i]);
+                tjDestroy(image->decoder.jpeg);
+                free(image);
+                return NULL;
+            }
+        }
+    }
+    else if(strncmp(format, "YUYV", 4) == 0)
+    {
+        image->format = FORMAT_YUYV;
+        image->d.shader = SHADER_YUYV;
+    }
+    else if(strncmp(format, "NV12", 4) == 0)
+    {
+        image->format = FORMAT_NV12;
+        image->d.shader = SHADER_NV12;
+    }
+    else if(strncmp(format, "YU12", 4) == 0)
+    {
+        image->format = FORMAT_I420;
+        image->d.shader = SHADER_I420;
+    }
+    else
+    {
+        WARN("No convertor for `%4c` format", format);
+        free(image);
+        return NULL;
+    }
+
+    image->d.type = DRAWABLE_IMAGE;
+    image->d.mask[0] = 1;
+    image->d.mask[1] = 1;
+    image->d.mask[2] = 1;
+    image->d.mask[3] = 0;
+    image->d.color[0] = 0;
+    image->d.color[1] = 0;
+    image->d.color[2] = 0;
+    image->d.color[3] = 1;
+    image->d.num = 6;
+    image->d.mode = GL_TRIANGLES;
     image->width = width;
     image->height = height;
+    image->frame_height = height;
+    image->anchor = anchor;
+    image->d.g = g;
+
+    glGenBuffers(1, &(image->d.vbo));
+    image_geometry(image);
+    image_storage_create(image);
 
     return (drawable_t*)image;
 }
 
+void graphics_image_set_crop(drawable_t *d, uint32_t rows)
+{
+    DEBUG("graphics_image_set_crop()");
+    assert(d != 0);
+    assert(d->type == DRAWABLE_IMAGE);
+
+    struct _drawable_image *image = (struct _drawable_image*)d;
+    if((rows == 0) || (rows > image->frame_height)) rows = image->frame_height;
+
+    // Keep even rows for subsampled chroma
+    image->top = ((image->frame_height - rows) / 2) & ~1;
+    image->height = image->frame_height - image->top * 2;
+    INFO("Image cropped to %u rows from row %u", image->height, image->top);
+
+    image_storage_free(image);
+    image_storage_create(image);
+    image_geometry(image);
+}
+
 void graphics_image_set_bitmap(drawable_t *d, void *buffer, uint32_t len)
 {
     DEBUG("graphics_image_set_bitmap()");
@@ -169,30 +645,233 @@ void graphics_image_set_bitmap(drawable_t *d, void *buffer, uint32_t len)
     assert(d->type == DRAWABLE_IMAGE);
 
     struct _drawable_image *image = (struct _drawable_image*)d;
-    uint8_t dstbuf[image->width * image->height * 4];
+    if(image->decoder.jpeg)
+    {
+        // Decode scaled down to the image size, planes are kept in native subsampling
+        int width, height, subsamp, colorspace;
+        if((tjDecompressHeader3(image->decoder.jpeg, buffer, len, &width, &height, &subsamp, &colorspace) != 0) ||
+           !jpeg_scalable(width, height, image->width, image->frame_height) ||
+           ((image->format == FORMAT_I420) && (subsamp != TJSAMP_444) && (subsamp != TJSAMP_422) && (subsamp != TJSAMP_420)))
+        {
+            WARN("Unsupported JPEG frame");
+            return;
+        }
+
+        uint8_t *dstbuf = image->decode[image->decode_index];
+        PROFILE_BEGIN(DECODE);
+        len = (image->format == FORMAT_I420) ? jpeg_decode_planes(image->decoder.jpeg, buffer, len, dstbuf, image->width, image->frame_height, subsamp)
+                                             : jpeg_decode_rgbx(image->decoder.jpeg, buffer, len, dstbuf, image->width, image->frame_height);
+        PROFILE_END(DECODE);
+        if(!len)
+        {
+            WARN("JPEG decompression failed");
+            return;
+        }
+        image->decode_index = (image->decode_index + 1) % DECODE_BUFFERS;
+        buffer = dstbuf;
+    }
+
+    switch(image->format)
+    {
+        case FORMAT_YUYV:
+        case FORMAT_NV12:
+        case FORMAT_RGBA:
+            if(len < frame_size(image->format, image->width, image->frame_height))
+            {
+                WARN("Incomplete frame");
+                return;
+            }
+            break;
+
+        case FORMAT_I420:
+        default:
+            break;
+    }
+
+    struct plane planes[3];
+    int i, num = 0;
+
+    // Advance to the least recently used texture
+    image->current = (image->current + 1) % TEXTURE_RING;
+    image->d.tex = image->ring[image->current].tex;
+
+    const GLubyte *src = buffer;
+    GLuint w = image->width, h = image->height, fh = image->frame_height, top = image->top;
+    GLsizei chroma_width = 0, chroma_height = 0, chroma_top = 0;
     switch(image->format)
     {
-        case FORMAT_MJPEG:
-            if(tjDecompress2(image->decoder.jpeg, buffer, len, dstbuf, image->width, image->width * 4, image->height,
-                             TJPF_RGBX, TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE) == 0)
+        case FORMAT_YUYV:
+            planes[num++] = (struct plane){ image->d.tex, GL_LUMINANCE_ALPHA, w, h, src + top * w * 2, w * h * 2 };
+            break;
+
+        case FORMAT_NV12:
+            planes[num++] = (struct plane){ image->d.tex, GL_LUMINANCE, w, h, src + top * w, w * h };
+            planes[num++] = (struct plane){ image->ring[image->current].planes[0], GL_LUMINANCE_ALPHA, w / 2, h / 2,
+                                                 src + w * fh + top / 2 * w, w * h / 2 };
+            break;
+
+        case FORMAT_I420:
+        {
+            // Planar frames carry their chroma subsampling in length
+            GLsizei chroma_frame_height;
+            if(!planar_chroma(image, len, &chroma_width, &chroma_frame_height))
             {
-                buffer = dstbuf;
+                WARN("Incomplete planar frame");
+                return;
             }
-            else WARN("JPEG decompression failed");
+            chroma_height = h * chroma_frame_height / fh;
+            chroma_top = top * chroma_frame_height / fh;
+
+            const GLubyte *u = src + w * fh, *v = u + chroma_width * chroma_frame_height;
+            planes[num++] = (struct plane){ image->d.tex, GL_LUMINANCE, w, h, src + top * w, w * h };
+            planes[num++] = (struct plane){ image->ring[image->current].planes[0], GL_LUMINANCE, chroma_width, chroma_height,
+                                                 u + chroma_top * chroma_width, chroma_width * chroma_height };
+            planes[num++] = (struct plane){ image->ring[image->current].planes[1], GL_LUMINANCE, chroma_width, chroma_height,
+                                                 v + chroma_top * chroma_width, chroma_width * chroma_height };
             break;
+        }
 
         case FORMAT_RGBA:
         default:
+            planes[num++] = (struct plane){ image->d.tex, GL_RGBA, w, h, src + top * w * 4, w * h * 4 };
             break;
     }
 
-    glBindTexture(GL_TEXTURE_2D, image->d.tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->width, image->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+    size_t size = 0;
+    for(i = 0; i < num; i++) size += planes[i].size;
+
+    // Write visible rows to mapped unpack buffer, texture is then updated asynchronously
+    PROFILE_BEGIN(UPLOAD);
+    GLuint pbo = image->ring[image->current].pbo;
+    if(pbo)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        if(size > image->ring[image->current].pbo_size)
+        {
+            // Grow for chroma subsampling with more samples than expected
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+            image->ring[image->current].pbo_size = size;
+        }
+
+        // Invalidation lets the driver hand out fresh storage instead of waiting for the previous upload
+        GLubyte *dst = image->d.g->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT_EXT | GL_MAP_INVALIDATE_BUFFER_BIT_EXT);
+        if(dst)
+        {
+            size_t offset = 0;
+            for(i = 0; i < num; i++)
+            {
+                memcpy(dst + offset, planes[i].data, planes[i].size);
+                offset += planes[i].size;
+            }
+        }
+
+        if(dst && image->d.g->unmap_buffer(GL_PIXEL_UNPACK_BUFFER))
+        {
+            // Planes are now sourced from buffer offsets
+            size_t offset = 0;
+            for(i = 0; i < num; i++)
+            {
+                planes[i].data = (const GLubyte*)(uintptr_t)offset;
+                offset += planes[i].size;
+            }
+        }
+        else
+        {
+            // Mapping failed or buffer contents were lost, upload from client memory
+            WARN("Failed to map unpack buffer");
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            pbo = 0;
+        }
+    }
+
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    for(i = 0; i < num; i++)
+    {
+        state_bind_texture(image->d.g, 0, planes[i].tex);
+        if((i > 0) && chroma_width && ((image->ring[image->current].chroma_width != chroma_width) ||
+                                       (image->ring[image->current].chroma_height != chroma_height)))
+        {
+            // Subsampling changed, reallocate
+            glTexImage2D(GL_TEXTURE_2D, 0, planes[i].format, planes[i].width, planes[i].height, 0, planes[i].format, GL_UNSIGNED_BYTE, planes[i].data);
+        }
+        else
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, planes[i].width, planes[i].height, planes[i].format, GL_UNSIGNED_BYTE, planes[i].data);
+        }
+    }
+    if(chroma_width)
+    {
+        image->ring[image->current].chroma_width = chroma_width;
+        image->ring[image->current].chroma_height = chroma_height;
+    }
+    if(pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    PROFILE_END(UPLOAD);
+
+    image->d.g->stats.frames_uploaded++;
+    image->d.g->stats.bytes_uploaded += size;
+}
+
+int graphics_image_set_dmabuf(drawable_t *d, int fd, uint32_t stride)
+{
+    DEBUG("graphics_image_set_dmabuf()");
+    assert(d != 0);
+    assert(d->type == DRAWABLE_IMAGE);
+
+    struct _drawable_image *image = (struct _drawable_image*)d;
+    if(!image->d.g->create_image || image->import_failed || (image->format != FORMAT_RGBA)) return 0;
+
+    // Find cached import
+    int i;
+    for(i = 0; i < image->import_num; i++)
+    {
+        if(image->imports[i].fd == fd) break;
+    }
+
+    if(i == image->import_num)
+    {
+        if(image->import_num == IMPORT_MAX)
+        {
+            WARN("Too many imported buffers");
+            return 0;
+        }
+
+        EGLint attr[] =
+        {
+            EGL_WIDTH, image->width,
+            EGL_HEIGHT, image->height,
+            EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_XBGR8888,
+            EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+            EGL_DMA_BUF_PLANE0_OFFSET_EXT, image->top * stride,
+            EGL_DMA_BUF_PLANE0_PITCH_EXT, stride,
+            EGL_NONE
+        };
+
+        // Import buffer
+        EGLImageKHR egl_image = image->d.g->create_image(image->d.g->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attr);
+        if(egl_image == EGL_NO_IMAGE_KHR)
+        {
+            WARN("Failed to import DMABUF");
+            image->import_failed = 1;
+            return 0;
+        }
+
+        // Bind to texture
+        image->imports[i].fd = fd;
+        image->imports[i].image = egl_image;
+        glGenTextures(1, &image->imports[i].tex);
+        state_bind_texture(image->d.g, 0, image->imports[i].tex);
+        image->d.g->image_target_texture(GL_TEXTURE_2D, egl_image);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        image->import_num++;
+        INFO("Imported DMABUF %d", fd);
+    }
+
+    image->d.tex = image->imports[i].tex;
+    image->d.g->stats.frames_imported++;
+    return 1;
 }
 
 void graphics_drawable_free(drawable_t *d)
@@ -200,12 +879,20 @@ void graphics_drawable_free(drawable_t *d)
     DEBUG("graphics_drawable_free()");
     assert(d != 0);
 
-    glDeleteBuffers(1, &d->vbo);
-    if(d->type != DRAWABLE_LABEL) glDeleteTextures(1, &d->tex);
     if(d->type == DRAWABLE_IMAGE)
     {
         struct _drawable_image *image = (struct _drawable_image*)d;
-        if(image->format == FORMAT_MJPEG) tjDestroy(image->decoder.jpeg);
+        if(image->decoder.jpeg)
+        {
+            int i;
+            tjDestroy(image->decoder.jpeg);
+            for(i = 0; i < DECODE_BUFFERS; i++) free(image->decode[i]);
+        }
+        image_storage_free(image);
     }
+    if(d->type == DRAWABLE_LABEL) label_release(d);
+    state_delete_buffer(d->g, d->vbo);
+    if((d->type == DRAWABLE_BASE) || (d->type == DRAWABLE_LAYER)) state_delete_textures(d->g, 1, &d->tex);
+    free(d->vertices);
     free(d);
 }
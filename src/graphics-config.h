@@ -0,0 +1,82 @@
+/**
+ * @file
+ * @brief       Graphics library - configuration
+ * @author      Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * @section LICENSE
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at
+ * <http://www.gnu.org/licenses>
+ *
+ * @section DESCRIPTION
+ * These are configuration definitions for graphics library.
+ */
+
+#ifndef GRAPHICS_CONFIG_H
+#define GRAPHICS_CONFIG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Graphics configuration structure
+ */
+struct graphics_config
+{
+    /**
+     * @brief Render to an offscreen pbuffer instead of native window, Mesa surfaceless platform is used if available
+     */
+    bool offscreen;
+
+    /**
+     * @brief Offscreen surface width in pixels
+     */
+    uint32_t width;
+
+    /**
+     * @brief Offscreen surface height in pixels
+     */
+    uint32_t height;
+
+    /**
+     * @brief Swap interval in vertical blanks, 0 disables synchronization
+     */
+    uint32_t swap_interval;
+
+    /**
+     * @brief Target frame rate, frames are paced by a timer before swap, 0 to disable
+     * @note Swap blocks on the timer, do not use when rendering is driven by an event loop
+     */
+    float frame_rate;
+
+    /**
+     * @brief MJPEG images are decoded to Y, U and V planes converted by shader instead of RGBx
+     */
+    bool decode_yuv;
+
+    /**
+     * @brief Directory of linked shader program cache, NULL to always compile from source
+     */
+    char *shader_cache;
+
+    /**
+     * @brief File the rendered frames are read back to, NULL to disable
+     * @note Names ending with ".png" are overwritten by the last frame as PNG image,
+     * other files receive a stream of raw RGBA frames.
+     */
+    char *readback_file;
+
+    /**
+     * @brief Read back only every n-th frame, 0 or 1 for every frame
+     */
+    uint32_t readback_interval;
+};
+
+#endif /* GRAPHICS_CONFIG_H */
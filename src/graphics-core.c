@@ -18,8 +18,15 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <png.h>
 
 #include "debug.h"
+#include "profile.h"
 #include "graphics.h"
 
 #define GRAPHICS_PRIV_H
@@ -49,6 +56,96 @@
 "  gl_FragColor = texture2D(tex, texpos) * mask + color;\n" \
 "}\n"
 
+/* Batched drawing, vertices are already transformed and carry their own colors */
+#define SHADER_VERTEX_BATCH_SRC \
+"attribute vec4 coord;\n" \
+"attribute vec4 vcolor;\n" \
+"attribute vec4 vmask;\n" \
+"varying vec2 texpos;\n" \
+"varying vec4 fcolor;\n" \
+"varying vec4 fmask;\n" \
+"void main()\n" \
+"{\n" \
+"  gl_Position = vec4(coord.xy, 0, 1);\n" \
+"  texpos = coord.zw;\n" \
+"  fcolor = vcolor;\n" \
+"  fmask = vmask;\n" \
+"}\n"
+
+#define SHADER_FRAGMENT_BATCH_SRC \
+"uniform sampler2D tex;\n" \
+"varying mediump vec2 texpos;\n" \
+"varying mediump vec4 fcolor;\n" \
+"varying mediump vec4 fmask;\n" \
+"void main()\n" \
+"{\n" \
+"  gl_FragColor = texture2D(tex, texpos) * fmask + fcolor;\n" \
+"}\n"
+
+/* Batched distance field text, edge smoothing is carried in color alpha */
+#define SHADER_FRAGMENT_SDF_SRC \
+"uniform sampler2D tex;\n" \
+"varying mediump vec2 texpos;\n" \
+"varying mediump vec4 fcolor;\n" \
+"varying mediump vec4 fmask;\n" \
+"void main()\n" \
+"{\n" \
+"  mediump float dist = texture2D(tex, texpos).a;\n" \
+"  gl_FragColor = vec4(fcolor.rgb, smoothstep(0.5 - fcolor.a, 0.5 + fcolor.a, dist) * fmask.a);\n" \
+"}\n"
+
+/* Common part of YUV shaders, BT.601 limited range conversion */
+#define SHADER_FRAGMENT_YUV_SRC \
+"#ifdef GL_FRAGMENT_PRECISION_HIGH\n" \
+"precision highp float;\n" \
+"#else\n" \
+"precision mediump float;\n" \
+"#endif\n" \
+"uniform vec4 color;\n" \
+"uniform vec4 mask;\n" \
+"uniform sampler2D tex;\n" \
+"varying vec2 texpos;\n" \
+"vec4 yuv2rgb(float y, float u, float v)\n" \
+"{\n" \
+"  y = 1.1643 * (y - 0.0625);\n" \
+"  u -= 0.5;\n" \
+"  v -= 0.5;\n" \
+"  return vec4(y + 1.5958 * v, y - 0.39173 * u - 0.8129 * v, y + 2.017 * u, 1.0);\n" \
+"}\n"
+
+/* Packed YUYV in luminance/alpha texture, chroma is taken from the even and odd texel */
+#define SHADER_FRAGMENT_YUYV_SRC SHADER_FRAGMENT_YUV_SRC \
+"uniform vec2 texsize;\n" \
+"void main()\n" \
+"{\n" \
+"  float x = floor(texpos.x * texsize.x);\n" \
+"  float even = x - mod(x, 2.0);\n" \
+"  float u = texture2D(tex, vec2((even + 0.5) / texsize.x, texpos.y)).a;\n" \
+"  float v = texture2D(tex, vec2((even + 1.5) / texsize.x, texpos.y)).a;\n" \
+"  gl_FragColor = yuv2rgb(texture2D(tex, texpos).r, u, v) * mask + color;\n" \
+"}\n"
+
+/* Semi-planar NV12, luminance texture and half size luminance/alpha chroma texture */
+#define SHADER_FRAGMENT_NV12_SRC SHADER_FRAGMENT_YUV_SRC \
+"uniform sampler2D plane1;\n" \
+"void main()\n" \
+"{\n" \
+"  vec4 uv = texture2D(plane1, texpos);\n" \
+"  gl_FragColor = yuv2rgb(texture2D(tex, texpos).r, uv.r, uv.a) * mask + color;\n" \
+"}\n"
+
+/* Planar YUV, luminance texture for each plane, JFIF full range as decoded from JPEG */
+#define SHADER_FRAGMENT_I420_SRC SHADER_FRAGMENT_YUV_SRC \
+"uniform sampler2D plane1;\n" \
+"uniform sampler2D plane2;\n" \
+"void main()\n" \
+"{\n" \
+"  float y = texture2D(tex, texpos).r;\n" \
+"  float u = texture2D(plane1, texpos).r - 0.5;\n" \
+"  float v = texture2D(plane2, texpos).r - 0.5;\n" \
+"  gl_FragColor = vec4(y + 1.402 * v, y - 0.34414 * u - 0.71414 * v, y + 1.772 * u, 1.0) * mask + color;\n" \
+"}\n"
+
 #define LINE_WIDTH 3
 
 static GLuint shader_compile(GLenum type, const GLchar *source, GLint length)
@@ -83,6 +180,9 @@ static GLuint shader_link(GLuint vertex, GLuint fragment)
     GLuint program = glCreateProgram();
     glAttachShader(program, vertex);
     glAttachShader(program, fragment);
+    glBindAttribLocation(program, ATTR_COORD, "coord");
+    glBindAttribLocation(program, ATTR_COLOR, "vcolor");
+    glBindAttribLocation(program, ATTR_MASK, "vmask");
     glLinkProgram(program);
 
     // Get link status
@@ -104,15 +204,374 @@ static GLuint shader_link(GLuint vertex, GLuint fragment)
     return program;
 }
 
-graphics_t *graphics_init(uint32_t window)
+uint64_t hash_data(uint64_t h, const void *data, size_t length)
+{
+    const uint8_t *ptr = data;
+    while(length--) h = (h ^ *ptr++) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Gets cache file name of program, keyed by driver and shader sources */
+static void cache_path(graphics_t *g, const GLchar *vertex_source, GLint vertex_length, const GLchar *source, GLint length, char *path, size_t size)
+{
+    uint64_t h = HASH_INIT;
+    const char *strings[] = { (const char*)glGetString(GL_VENDOR), (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION) };
+    int i;
+    for(i = 0; i < sizeof(strings) / sizeof(*strings); i++)
+    {
+        if(strings[i]) h = hash_data(h, strings[i], strlen(strings[i]) + 1);
+    }
+    h = hash_data(h, vertex_source, vertex_length);
+    h = hash_data(h, source, length);
+    snprintf(path, size, "%s/%016llx.bin", g->config.shader_cache, (unsigned long long)h);
+}
+
+/* Checks whether binary format is supported by driver */
+static int cache_format_supported(GLenum format)
+{
+    GLint i, num = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num);
+    if(num < 1) return 0;
+
+    GLint *formats = malloc(num * sizeof(GLint));
+    assert(formats != 0);
+    glGetIntegerv(GL_PROGRAM_BINARY_FORMATS_OES, formats);
+    for(i = 0; (i < num) && ((GLenum)formats[i] != format); i++);
+    free(formats);
+    return i < num;
+}
+
+/* Loads linked program from cache, returns 0 if missing or rejected by driver, invalid files are removed */
+static GLuint cache_load(graphics_t *g, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if(!fp) return 0;
+
+    // File holds binary format followed by the binary
+    GLenum format;
+    long size;
+    void *binary = NULL;
+    GLuint program = 0;
+    if((fread(&format, sizeof(format), 1, fp) != 1) || !cache_format_supported(format) ||
+       (fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp) - (long)sizeof(format)) <= 0) || (fseek(fp, sizeof(format), SEEK_SET) != 0))
+    {
+        WARN("Invalid program cache `%s`", path);
+        goto finalize;
+    }
+    binary = malloc(size);
+    assert(binary != 0);
+    if(fread(binary, size, 1, fp) != 1)
+    {
+        WARN("Invalid program cache `%s`", path);
+        goto finalize;
+    }
+
+    // Driver may reject binaries after update
+    GLint status;
+    program = glCreateProgram();
+    g->program_binary(program, format, binary, size);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(!status)
+    {
+        INFO("Program cache `%s` rejected", path);
+        glDeleteProgram(program);
+        program = 0;
+
+        // Clear errors raised by the rejected binary, so they are not reported at initialization
+        while(glGetError() != GL_NO_ERROR);
+    }
+
+finalize:
+    free(binary);
+    fclose(fp);
+
+    // Remove the file, it is replaced by the compiled program
+    if(!program) unlink(path);
+    return program;
+}
+
+/* Stores linked program to cache */
+static void cache_store(graphics_t *g, GLuint program, const char *path)
+{
+    GLint size;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &size);
+    if(size <= 0) return;
+
+    GLenum format;
+    void *binary = malloc(size);
+    assert(binary != 0);
+    g->get_program_binary(program, size, &size, &format, binary);
+
+    // Write whole file before replacing the old one, so others never load a truncated binary
+    char tmp[256 + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if(!fp)
+    {
+        WARN("Failed to write program cache `%s`", path);
+        free(binary);
+        return;
+    }
+
+    int written = (fwrite(&format, sizeof(format), 1, fp) == 1) && (fwrite(binary, size, 1, fp) == 1);
+    if((fclose(fp) != 0) || !written || (rename(tmp, path) != 0))
+    {
+        WARN("Failed to write program cache `%s`", path);
+        unlink(tmp);
+    }
+    free(binary);
+}
+
+/* Creates program from cache or compiles it, vertex shader is shared and compiled on first use */
+static GLuint program_create(graphics_t *g, GLuint *vertex, const GLchar *vertex_source, GLint vertex_length, GLuint *fragment, const GLchar *source, GLint length)
+{
+    char path[256];
+    GLuint program;
+    if(g->program_binary)
+    {
+        cache_path(g, vertex_source, vertex_length, source, length, path, sizeof(path));
+        if((program = cache_load(g, path)))
+        {
+            g->programs_loaded++;
+            return program;
+        }
+    }
+
+    // Compile and link program
+    if((!*vertex && !(*vertex = shader_compile(GL_VERTEX_SHADER, vertex_source, vertex_length))) ||
+       !(*fragment = shader_compile(GL_FRAGMENT_SHADER, source, length)) ||
+       !(program = shader_link(*vertex, *fragment)))
+    {
+        return 0;
+    }
+    g->programs_compiled++;
+
+    if(g->program_binary) cache_store(g, program, path);
+    return program;
+}
+
+static int shader_create(graphics_t *g, struct shader *shader, GLuint *vertex, const GLchar *vertex_source, GLint vertex_length, const GLchar *source, GLint length)
+{
+    // Create program
+    if(!(shader->prog = program_create(g, vertex, vertex_source, vertex_length, &shader->frag, source, length)))
+    {
+        return 0;
+    }
+
+    // Get shader attributes
+    glUseProgram(shader->prog);
+    shader->uni_tex = glGetUniformLocation(shader->prog, "tex");  // Texture
+    shader->uni_planes[0] = glGetUniformLocation(shader->prog, "plane1");  // Second texture plane (optional)
+    shader->uni_planes[1] = glGetUniformLocation(shader->prog, "plane2");  // Third texture plane (optional)
+    shader->uni_texsize = glGetUniformLocation(shader->prog, "texsize");  // Texture size in texels (optional)
+    shader->uni_color = glGetUniformLocation(shader->prog, "color"); // RGBA drawing color
+    shader->uni_mask = glGetUniformLocation(shader->prog, "mask"); // RGBA color mask
+    shader->uni_offset = glGetUniformLocation(shader->prog, "offset"); // X, Y drawing coordinates
+    shader->uni_scale = glGetUniformLocation(shader->prog, "scale"); // Scale coefficient
+    shader->uni_rot = glGetUniformLocation(shader->prog, "rot"); // Rotation angle [rad]
+    if((shader->uni_tex == -1) || (shader->uni_color == -1) || (shader->uni_mask == -1) || (shader->uni_offset == -1) || (shader->uni_scale == -1) || (shader->uni_rot == -1))
+    {
+        WARN("Failed to get attribute locations");
+        return 0;
+    }
+
+    // Assign texture units
+    glUniform1i(shader->uni_tex, 0);
+    if(shader->uni_planes[0] != -1) glUniform1i(shader->uni_planes[0], 1);
+    if(shader->uni_planes[1] != -1) glUniform1i(shader->uni_planes[1], 2);
+
+    return 1;
+}
+
+void state_use_program(struct _graphics *g, GLuint prog)
+{
+    if(g->state.prog == prog)
+    {
+        g->stats.state_elided++;
+        return;
+    }
+
+    glUseProgram(prog);
+    g->state.prog = prog;
+    g->stats.state_issued++;
+}
+
+void state_bind_texture(struct _graphics *g, GLuint unit, GLuint tex)
+{
+    if(g->state.tex[unit] == tex)
+    {
+        g->stats.state_elided++;
+        return;
+    }
+
+    if(g->state.unit != unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        g->state.unit = unit;
+        g->stats.state_issued++;
+    }
+    glBindTexture(GL_TEXTURE_2D, tex);
+    g->state.tex[unit] = tex;
+    g->stats.state_issued++;
+}
+
+void state_bind_buffer(struct _graphics *g, GLuint vbo)
+{
+    if(g->state.vbo == vbo)
+    {
+        g->stats.state_elided++;
+        return;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    g->state.vbo = vbo;
+    g->stats.state_issued++;
+}
+
+void state_attrib_pointer(struct _graphics *g, GLsizei stride)
+{
+    if((g->state.pointer_vbo == g->state.vbo) && (g->state.pointer_stride == stride))
+    {
+        g->stats.state_elided++;
+        return;
+    }
+
+    // Color and mask arrays are only enabled for batched layout
+    glVertexAttribPointer(ATTR_COORD, 4, GL_FLOAT, GL_FALSE, stride * sizeof(GLfloat), (void*)0);
+    if(stride == BATCH_STRIDE)
+    {
+        glVertexAttribPointer(ATTR_COLOR, 4, GL_FLOAT, GL_FALSE, stride * sizeof(GLfloat), (void*)(4 * sizeof(GLfloat)));
+        glVertexAttribPointer(ATTR_MASK, 4, GL_FLOAT, GL_FALSE, stride * sizeof(GLfloat), (void*)(8 * sizeof(GLfloat)));
+        if(g->state.pointer_stride != BATCH_STRIDE)
+        {
+            glEnableVertexAttribArray(ATTR_COLOR);
+            glEnableVertexAttribArray(ATTR_MASK);
+        }
+    }
+    else if(g->state.pointer_stride == BATCH_STRIDE)
+    {
+        glDisableVertexAttribArray(ATTR_COLOR);
+        glDisableVertexAttribArray(ATTR_MASK);
+    }
+    g->state.pointer_vbo = g->state.vbo;
+    g->state.pointer_stride = stride;
+    g->stats.state_issued++;
+}
+
+void state_uniform(struct _graphics *g, GLint location, GLfloat *shadow, const GLfloat *value, GLsizei size)
+{
+    if(location == -1) return;
+    if(!memcmp(shadow, value, size * sizeof(GLfloat)))
+    {
+        g->stats.state_elided++;
+        return;
+    }
+
+    switch(size)
+    {
+        case 1: glUniform1fv(location, 1, value); break;
+        case 2: glUniform2fv(location, 1, value); break;
+        case 4: glUniform4fv(location, 1, value); break;
+    }
+    memcpy(shadow, value, size * sizeof(GLfloat));
+    g->stats.state_issued++;
+}
+
+void state_delete_textures(struct _graphics *g, GLsizei num, const GLuint *textures)
+{
+    // Deleted textures are unbound, their names may be reused
+    GLsizei i, j;
+    for(i = 0; i < num; i++)
+    {
+        for(j = 0; j < TEXTURE_UNITS; j++)
+        {
+            if(textures[i] && (g->state.tex[j] == textures[i])) g->state.tex[j] = 0;
+        }
+    }
+    glDeleteTextures(num, textures);
+}
+
+void state_delete_buffer(struct _graphics *g, GLuint vbo)
+{
+    // Deleted buffer is unbound, its name may be reused
+    if(vbo && (g->state.vbo == vbo)) g->state.vbo = 0;
+    if(vbo && (g->state.pointer_vbo == vbo)) g->state.pointer_vbo = STATE_UNKNOWN;
+    glDeleteBuffers(1, &vbo);
+}
+
+/* Writes RGBA frame as RGB PNG image */
+static int png_write(const char *file, const uint8_t *pixels, uint32_t width, uint32_t height)
+{
+    FILE *fp = fopen(file, "wb");
+    if(!fp)
+    {
+        WARN("Failed to open `%s`", file);
+        return 0;
+    }
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    assert(png != 0);
+
+    png_infop info = png_create_info_struct(png);
+    assert(info != 0);
+
+    if(setjmp(png_jmpbuf(png)))
+    {
+        WARN("Failed to write `%s`", file);
+        png_destroy_write_struct(&png, &info);
+        fclose(fp);
+        return 0;
+    }
+
+    uint32_t i;
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    png_set_filler(png, 0, PNG_FILLER_AFTER);
+    for(i = 0; i < height; i++) png_write_row(png, (png_const_bytep)pixels + i * width * 4);
+    png_write_end(png, NULL);
+
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+    return 1;
+}
+
+/* Reads back rendered frame to configured file */
+static void readback(graphics_t *g)
+{
+    graphics_read_pixels(g, g->pixels);
+    if(g->readback)
+    {
+        if(fwrite(g->pixels, g->width * g->height * 4, 1, g->readback) != 1) WARN("Failed to write frame");
+    }
+    else
+    {
+        png_write(g->config.readback_file, g->pixels, g->width, g->height);
+    }
+    g->stats.frames_read++;
+}
+
+graphics_t *graphics_init(uint32_t window, const struct graphics_config *config)
 {
     DEBUG("graphics_init()");
+    assert(config != 0);
 
+    int i;
     graphics_t *g = calloc(1, sizeof(struct _graphics));
     assert(g != 0);
+    memcpy(&g->config, config, sizeof(struct graphics_config));
+    g->pacer = -1;
+
+    // Prefer surfaceless platform for offscreen rendering, it needs no display server
+    const char *client_ext = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if(config->offscreen && client_ext && strstr(client_ext, "EGL_MESA_platform_surfaceless"))
+    {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if(get_platform_display) g->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
 
     // Get display
-    if((g->display = eglGetDisplay(EGL_DEFAULT_DISPLAY)) == NULL)
+    if(!g->display && ((g->display = eglGetDisplay(EGL_DEFAULT_DISPLAY)) == NULL))
     {
         WARN("Failed to get display");
         goto error;
@@ -125,25 +584,46 @@ graphics_t *graphics_init(uint32_t window)
         goto error;
     }
 
-    // Configure EGL
-    EGLConfig config;
-    EGLint num, config_attr[5] = { EGL_SURFACE_TYPE, EGL_WINDOW_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT, EGL_NONE };
-    if(!eglChooseConfig(g->display, config_attr, &config, 1, &num) || (num != 1))
+    // Configure EGL, offscreen surface must be readable as RGB
+    EGLConfig egl_config;
+    EGLint num, config_attr[] =
+    {
+        EGL_SURFACE_TYPE, config->offscreen ? EGL_PBUFFER_BIT : EGL_WINDOW_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    if(!config->offscreen) config_attr[4] = EGL_NONE;
+    if(!eglChooseConfig(g->display, config_attr, &egl_config, 1, &num) || (num != 1))
     {
         WARN("Failed to configure EGL");
         goto error;
     }
 
-    // Create window surface
-    if((g->surface = eglCreateWindowSurface(g->display, config, window, NULL)) == NULL)
+    if(config->offscreen)
     {
-        WARN("EGL failed to create window surface");
-        goto error;
+        // Create pbuffer surface
+        EGLint pbuffer_attr[] = { EGL_WIDTH, config->width, EGL_HEIGHT, config->height, EGL_NONE };
+        if((g->surface = eglCreatePbufferSurface(g->display, egl_config, pbuffer_attr)) == NULL)
+        {
+            WARN("EGL failed to create pbuffer surface");
+            goto error;
+        }
+        INFO("Rendering offscreen at %ux%u", config->width, config->height);
+    }
+    else
+    {
+        // Create window surface
+        if((g->surface = eglCreateWindowSurface(g->display, egl_config, window, NULL)) == NULL)
+        {
+            WARN("EGL failed to create window surface");
+            goto error;
+        }
     }
 
     // Create OpenGL context
     EGLint context_attr[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
-    if((g->context = eglCreateContext(g->display, config, NULL, context_attr)) == NULL)
+    if((g->context = eglCreateContext(g->display, egl_config, NULL, context_attr)) == NULL)
     {
         WARN("EGL failed to create OpenGL context\n");
         goto error;
@@ -156,32 +636,111 @@ graphics_t *graphics_init(uint32_t window)
         goto error;
     }
 
-    // Compile shader
+    // Set swap interval
+    if(!eglSwapInterval(g->display, config->swap_interval))
+    {
+        WARN("Failed to set swap interval %u", config->swap_interval);
+    }
+
+    // Arm frame pacing timer
+    if(config->frame_rate > 0)
+    {
+        long period = 1e9 / config->frame_rate;
+        struct itimerspec its;
+        its.it_interval.tv_sec = its.it_value.tv_sec = period / 1000000000;
+        its.it_interval.tv_nsec = its.it_value.tv_nsec = period % 1000000000;
+        if(((g->pacer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) || (timerfd_settime(g->pacer, 0, &its, NULL) == -1))
+        {
+            WARN("Failed to arm frame pacing timer");
+            goto error;
+        }
+        INFO("Pacing frames at %f fps", config->frame_rate);
+    }
+
+    // Load DMABUF import extension
+    const char *egl_ext = eglQueryString(g->display, EGL_EXTENSIONS);
+    const char *gl_ext = (const char*)glGetString(GL_EXTENSIONS);
+    if(egl_ext && strstr(egl_ext, "EGL_EXT_image_dma_buf_import") && gl_ext && strstr(gl_ext, "GL_OES_EGL_image"))
+    {
+        g->create_image = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+        g->destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+        g->image_target_texture = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+        if(!g->create_image || !g->destroy_image || !g->image_target_texture) g->create_image = NULL;
+    }
+    INFO("DMABUF import %s", g->create_image ? "supported" : "not supported");
+
+    // Check for asynchronous upload support
+    const char *gl_ver = (const char*)glGetString(GL_VERSION);
+    GLboolean gles3 = gl_ver && (strncmp(gl_ver, "OpenGL ES ", 10) == 0) && (atoi(gl_ver + 10) >= 3);
+    if(gles3)
+    {
+        g->map_buffer_range = (PFNGLMAPBUFFERRANGEEXTPROC)eglGetProcAddress("glMapBufferRange");
+        g->unmap_buffer = (PFNGLUNMAPBUFFEROESPROC)eglGetProcAddress("glUnmapBuffer");
+    }
+    g->unpack_buffer = gles3 && g->map_buffer_range && g->unmap_buffer;
+    INFO("Pixel unpack buffers %s", g->unpack_buffer ? "supported" : "not supported");
+
+    // Load program binary extension, it is core since GLES 3.0
+    GLint formats = 0;
+    if(config->shader_cache)
+    {
+        if(gl_ext && strstr(gl_ext, "GL_OES_get_program_binary"))
+        {
+            g->get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinaryOES");
+            g->program_binary = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+        }
+        else if(gles3)
+        {
+            g->get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinary");
+            g->program_binary = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinary");
+        }
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+        if(!g->get_program_binary || !g->program_binary || (formats < 1)) g->program_binary = NULL;
+        else if((mkdir(config->shader_cache, 0755) == -1) && (errno != EEXIST)) WARN("Failed to create `%s`", config->shader_cache);
+        INFO("Program binary cache %s", g->program_binary ? "supported" : "not supported");
+    }
+
+    // Create shader programs, linked binaries are loaded from cache if possible
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     static const GLchar shader_vert[] = SHADER_VERTEX_SRC;
-    static const GLchar shader_frag[] = SHADER_FRAGMENT_SRC;
-    if(!(g->vert = shader_compile(GL_VERTEX_SHADER, shader_vert, sizeof(shader_vert))) ||
-       !(g->frag = shader_compile(GL_FRAGMENT_SHADER, shader_frag, sizeof(shader_frag))) ||
-       !(g->prog = shader_link(g->vert, g->frag)))
+    static const GLchar shader_frag_rgba[] = SHADER_FRAGMENT_SRC;
+    static const GLchar shader_frag_yuyv[] = SHADER_FRAGMENT_YUYV_SRC;
+    static const GLchar shader_frag_nv12[] = SHADER_FRAGMENT_NV12_SRC;
+    static const GLchar shader_frag_i420[] = SHADER_FRAGMENT_I420_SRC;
+    if(!shader_create(g, &g->shaders[SHADER_RGBA], &g->vert, shader_vert, sizeof(shader_vert), shader_frag_rgba, sizeof(shader_frag_rgba)) ||
+       !shader_create(g, &g->shaders[SHADER_YUYV], &g->vert, shader_vert, sizeof(shader_vert), shader_frag_yuyv, sizeof(shader_frag_yuyv)) ||
+       !shader_create(g, &g->shaders[SHADER_NV12], &g->vert, shader_vert, sizeof(shader_vert), shader_frag_nv12, sizeof(shader_frag_nv12)) ||
+       !shader_create(g, &g->shaders[SHADER_I420], &g->vert, shader_vert, sizeof(shader_vert), shader_frag_i420, sizeof(shader_frag_i420)))
     {
         WARN("Cannot compile shader");
         goto error;
     }
 
-    // Get shader attributes
-    glUseProgram(g->prog);
-    g->uni_tex = glGetUniformLocation(g->prog, "tex");  // Texture
-    g->uni_color = glGetUniformLocation(g->prog, "color"); // RGBA drawing color
-    g->uni_mask = glGetUniformLocation(g->prog, "mask"); // RGBA color mask
-    g->uni_offset = glGetUniformLocation(g->prog, "offset"); // X, Y drawing coordinates
-    g->uni_scale = glGetUniformLocation(g->prog, "scale"); // Scale coefficient
-    g->uni_rot = glGetUniformLocation(g->prog, "rot"); // Rotation angle [rad]
-    g->attr_coord = glGetAttribLocation(g->prog, "coord"); // Model vertex coordinates
-    if((g->uni_tex == -1) || (g->uni_color == -1) || (g->uni_mask == -1) || (g->uni_offset == -1) || (g->uni_scale == -1) || (g->uni_rot == -1) || (g->attr_coord == -1))
+    // Create draw list program
+    static const GLchar shader_vert_batch[] = SHADER_VERTEX_BATCH_SRC;
+    static const GLchar shader_frag_batch[] = SHADER_FRAGMENT_BATCH_SRC;
+    static const GLchar shader_frag_sdf[] = SHADER_FRAGMENT_SDF_SRC;
+    if(!(g->batch_prog = program_create(g, &g->batch_vert, shader_vert_batch, sizeof(shader_vert_batch), &g->batch_frag, shader_frag_batch, sizeof(shader_frag_batch))) ||
+       !(g->sdf_prog = program_create(g, &g->batch_vert, shader_vert_batch, sizeof(shader_vert_batch), &g->sdf_frag, shader_frag_sdf, sizeof(shader_frag_sdf))))
     {
-        WARN("Failed to get attribute locations");
+        WARN("Cannot compile shader");
         goto error;
     }
-    glEnableVertexAttribArray(g->attr_coord);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    INFO("Shader programs ready in %.2f ms, %u loaded from cache, %u compiled",
+         (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, g->programs_loaded, g->programs_compiled);
+    glUseProgram(g->batch_prog);
+    glUniform1i(glGetUniformLocation(g->batch_prog, "tex"), 0);
+    glUseProgram(g->sdf_prog);
+    glUniform1i(glGetUniformLocation(g->sdf_prog, "tex"), 0);
+    glGenBuffers(1, &g->batch_vbo);
+
+    // Use default program
+    glUseProgram(g->shaders[SHADER_RGBA].prog);
+    g->state.prog = g->shaders[SHADER_RGBA].prog;
+    g->state.pointer_vbo = STATE_UNKNOWN;
+    glEnableVertexAttribArray(ATTR_COORD);
 
     // Enable blending
     glEnable(GL_BLEND);
@@ -198,6 +757,23 @@ graphics_t *graphics_init(uint32_t window)
         goto error;
     }
 
+    // Open readback stream, PNG images are written whole
+    if(config->readback_file)
+    {
+        size_t len = strlen(config->readback_file);
+        if((len < 4) || strcmp(config->readback_file + len - 4, ".png"))
+        {
+            if((g->readback = fopen(config->readback_file, "wb")) == NULL)
+            {
+                WARN("Failed to open `%s`", config->readback_file);
+                goto error;
+            }
+        }
+        g->pixels = malloc((g->height + 1) * g->width * 4);
+        assert(g->pixels != 0);
+        INFO("Reading back frames to `%s`", config->readback_file);
+    }
+
     // Check OpenGL errors
     int err = glGetError();
     if(err != GL_NO_ERROR)
@@ -209,9 +785,21 @@ graphics_t *graphics_init(uint32_t window)
     return g;
 
 error:
-   if(g->prog) glDeleteProgram(g->prog);
+   for(i = 0; i < SHADER_NUM; i++)
+   {
+       if(g->shaders[i].prog) glDeleteProgram(g->shaders[i].prog);
+       if(g->shaders[i].frag) glDeleteShader(g->shaders[i].frag);
+   }
    if(g->vert) glDeleteShader(g->vert);
-   if(g->frag) glDeleteShader(g->frag);
+   if(g->sdf_prog) glDeleteProgram(g->sdf_prog);
+   if(g->sdf_frag) glDeleteShader(g->sdf_frag);
+   if(g->batch_prog) glDeleteProgram(g->batch_prog);
+   if(g->batch_frag) glDeleteShader(g->batch_frag);
+   if(g->batch_vert) glDeleteShader(g->batch_vert);
+   if(g->batch_vbo) glDeleteBuffers(1, &g->batch_vbo);
+   if(g->readback) fclose(g->readback);
+   if(g->pacer != -1) close(g->pacer);
+   free(g->pixels);
    if(g->display) eglMakeCurrent(g->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
    if(g->context) eglDestroyContext(g->display, g->context);
    if(g->surface) eglDestroySurface(g->display, g->surface);
@@ -224,7 +812,44 @@ int graphics_flush(graphics_t *g, const uint8_t *color)
     DEBUG("graphics_flush()");
     assert(g != 0);
 
+    int i;
+    // Draw collected list
+    batch_flush(g);
+    if(g->config.readback_file && !(g->stats.frames % (g->config.readback_interval ? g->config.readback_interval : 1))) readback(g);
+    g->stats.frames++;
+    g->stats.draw_calls += g->draw_calls;
+    g->stats.frame_draw_calls = g->draw_calls;
+    g->stats.label_layouts += g->frame_layouts;
+    g->stats.frame_label_layouts = g->frame_layouts;
+    g->stats.vertex_bytes += g->frame_bytes;
+    g->stats.frame_vertex_bytes = g->frame_bytes;
+    g->draw_calls = 0;
+    g->frame_layouts = 0;
+    g->frame_bytes = 0;
+
+    // Wait for pacing timer, expirations missed by late frames are dropped
+    uint64_t expirations;
+    if((g->pacer != -1) && (read(g->pacer, &expirations, sizeof(expirations)) != sizeof(expirations)))
+    {
+        WARN("Failed to read frame pacing timer");
+    }
+
+    // Measure swap duration and interval from the previous present
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PROFILE_BEGIN(SWAP);
     if(!eglSwapBuffers(g->display, g->surface)) return 0;
+    PROFILE_END(SWAP);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint32_t index = g->timing_num % TIMING_RECORDS;
+    g->swap_times[index] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    g->present_times[index] = g->last_present.tv_sec ? (end.tv_sec - g->last_present.tv_sec) * 1e3 + (end.tv_nsec - g->last_present.tv_nsec) / 1e6 : 0;
+    g->last_present = end;
+    g->timing_num++;
+
+    // Atlas textures are created and deleted without graphics object, revalidate bindings every frame
+    for(i = 0; i < TEXTURE_UNITS; i++) g->state.tex[i] = STATE_UNKNOWN;
     if(color)
     {
         glClearColor(color[0] / 255.0, color[1] / 255.0, color[2] / 255.0, 0);
@@ -242,14 +867,115 @@ int graphics_flush(graphics_t *g, const uint8_t *color)
     return 1;
 }
 
+void graphics_read_pixels(graphics_t *g, uint8_t *buffer)
+{
+    DEBUG("graphics_read_pixels()");
+    assert(g != 0);
+    assert(buffer != 0);
+
+    batch_flush(g);
+    glReadPixels(0, 0, g->width, g->height, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+
+    // Flip rows, the last row of readback buffer is used as temporary
+    if(!g->pixels)
+    {
+        g->pixels = malloc((g->height + 1) * g->width * 4);
+        assert(g->pixels != 0);
+    }
+    size_t row = g->width * 4;
+    uint8_t *tmp = g->pixels + g->height * row;
+    int i;
+    for(i = 0; i < g->height / 2; i++)
+    {
+        memcpy(tmp, buffer + i * row, row);
+        memcpy(buffer + i * row, buffer + (g->height - 1 - i) * row, row);
+        memcpy(buffer + (g->height - 1 - i) * row, tmp, row);
+    }
+}
+
+static int timing_compare(const void *a, const void *b)
+{
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/* Sorts recent records and gets percentiles by nearest rank */
+static void percentiles(const float *records, uint32_t num, float *p50, float *p95, float *p99)
+{
+    float sorted[TIMING_RECORDS];
+    memcpy(sorted, records, num * sizeof(float));
+    qsort(sorted, num, sizeof(float), timing_compare);
+
+    *p50 = num ? sorted[(uint32_t)ceilf(num * 0.50) - 1] : 0;
+    *p95 = num ? sorted[(uint32_t)ceilf(num * 0.95) - 1] : 0;
+    *p99 = num ? sorted[(uint32_t)ceilf(num * 0.99) - 1] : 0;
+}
+
+void graphics_get_timing(graphics_t *g, struct graphics_timing *timing)
+{
+    DEBUG("graphics_get_timing()");
+    assert(g != 0);
+    assert(timing != 0);
+
+    timing->frames = g->timing_num < TIMING_RECORDS ? g->timing_num : TIMING_RECORDS;
+    percentiles(g->swap_times, timing->frames, &timing->swap_p50, &timing->swap_p95, &timing->swap_p99);
+
+    // First frame has no previous present
+    if(g->timing_num <= TIMING_RECORDS)
+    {
+        percentiles(g->present_times + 1, timing->frames ? timing->frames - 1 : 0, &timing->present_p50, &timing->present_p95, &timing->present_p99);
+    }
+    else
+    {
+        percentiles(g->present_times, timing->frames, &timing->present_p50, &timing->present_p95, &timing->present_p99);
+    }
+}
+
+void graphics_get_stats(graphics_t *g, struct graphics_stats *stats)
+{
+    DEBUG("graphics_get_stats()");
+    assert(g != 0);
+    assert(stats != 0);
+
+    *stats = g->stats;
+}
+
 void graphics_free(graphics_t *g)
 {
     DEBUG("graphics_free()");
     assert(g != 0);
 
-    glDeleteProgram(g->prog);
+    INFO("Image frames uploaded %u (%llu bytes), imported %u", g->stats.frames_uploaded, (unsigned long long)g->stats.bytes_uploaded, g->stats.frames_imported);
+    INFO("Frames flushed %u, drawables %u, draw calls %u (%.1f per frame)", g->stats.frames, g->stats.draws, g->stats.draw_calls, g->stats.frames ? (float)g->stats.draw_calls / g->stats.frames : 0);
+    INFO("Label layouts %u (%.1f per frame), vertex bytes uploaded %llu (%.0f per frame)", g->stats.label_layouts, g->stats.frames ? (float)g->stats.label_layouts / g->stats.frames : 0,
+         (unsigned long long)g->stats.vertex_bytes, g->stats.frames ? (float)g->stats.vertex_bytes / g->stats.frames : 0);
+    INFO("State calls issued %u, elided %u", g->stats.state_issued, g->stats.state_elided);
+    if(g->config.readback_file) INFO("Frames read back %u", g->stats.frames_read);
+
+    struct graphics_timing timing;
+    graphics_get_timing(g, &timing);
+    INFO("Swap time p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, present interval p50 %.2f ms, p95 %.2f ms, p99 %.2f ms (last %u frames)",
+         timing.swap_p50, timing.swap_p95, timing.swap_p99, timing.present_p50, timing.present_p95, timing.present_p99, timing.frames);
+
+    int i;
+    for(i = 0; i < SHADER_NUM; i++)
+    {
+        glDeleteProgram(g->shaders[i].prog);
+        glDeleteShader(g->shaders[i].frag);
+    }
     glDeleteShader(g->vert);
-    glDeleteShader(g->frag);
+    glDeleteProgram(g->sdf_prog);
+    glDeleteShader(g->sdf_frag);
+    glDeleteProgram(g->batch_prog);
+    glDeleteShader(g->batch_frag);
+    glDeleteShader(g->batch_vert);
+    glDeleteBuffers(1, &g->batch_vbo);
+    free(g->batches);
+    free(g->vertices);
+    free(g->sorted);
+    if(g->readback) fclose(g->readback);
+    if(g->pacer != -1) close(g->pacer);
+    free(g->pixels);
     eglMakeCurrent(g->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
     eglDestroyContext(g->display, g->context);
     eglDestroySurface(g->display, g->surface);
@@ -18,9 +18,11 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 #include "debug.h"
+#include "profile.h"
 #include "graphics.h"
 
 #define GRAPHICS_PRIV_H
@@ -47,64 +49,65 @@
 /* Number of verticies per circle */
 #define CIRCLE_DIV              8
 
+/* Texture coordinate of the opaque texel */
+#define MESH_SOLID              .25
+
+/* Parts of the static line mesh, each spans vertices up to the first one of the next part */
+enum mesh_part
+{
+    PART_HORIZON = 0,
+    PART_HORIZON_ALT,
+    PART_TRACK_MARKER,
+    PART_BEARING_MARKER,
+    PART_COMPASS,
+    PART_NUM
+};
+
+/* Displayed values in their display resolution, positions in pixels */
+struct hud_key
+{
+    long speed, altitude, distance;
+    long horizon, pitch, roll, heading, track, bearing;
+    char waypoint[32];
+};
+
 struct _hud
 {
     float hfov, vfov;
     uint32_t font_size;
-    drawable_t *horizon_line, *horizon_alt, *track_marker, *bearing_marker, *compass_lines, *compass_labels[COMPASS_LABEL_NUM];
+    drawable_t *compass_labels[COMPASS_LABEL_NUM];
     drawable_t *speed_label, *altitude_label, *waypoint_label;
     graphics_t *g;
+
+    // Static lines sharing one texture, parts are drawn as vertex ranges, compass steps are counted from the minimum
+    drawable_t *mesh;
+    GLuint parts[PART_NUM + 1];
+    int compass_min, compass_max;
+
+    // Render target the HUD is drawn to, redrawn only when the key changes
+    GLuint fbo;
+    drawable_t *layer;
+    struct hud_key key;
+    int valid;
+    struct hud_stats stats;
 };
 
-static drawable_t *horizon_create(graphics_t *g, uint8_t color[4])
+/* Appends line segment to the mesh */
+static GLfloat *mesh_line(GLfloat *array, float x0, float y0, float s0, float x1, float y1, float s1)
 {
-    struct _drawable *d = malloc(sizeof(struct _drawable));
-    assert(d != 0);
-
-    d->type = DRAWABLE_BASE;
-    d->color[0] = color[0] / 255.0;
-    d->color[1] = color[1] / 255.0;
-    d->color[2] = color[2] / 255.0;
-    d->color[3] = 0;
-    d->mask[0] = 0;
-    d->mask[1] = 0;
-    d->mask[2] = 0;
-    d->mask[3] = color[3] / 255.0;
-    d->num = 4;
-    d->mode = GL_LINE_STRIP;
-
-    // Generate texture
-    GLchar buffer[] = { 0xFF, 0x00 };
-    glGenTextures(1, &(d->tex));
-    glBindTexture(GL_TEXTURE_2D, d->tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, sizeof(buffer), 1, 0, GL_ALPHA, GL_UNSIGNED_BYTE, buffer);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    // Generate geometry
-    GLfloat array[] =
-    {
-        -HORIZON_LENGTH_REL - 0.02, -0.04, -2, 0,
-        -HORIZON_LENGTH_REL, 0, 0, 0,
-        HORIZON_LENGTH_REL, 0, HORIZON_DASH_NUM, 0,
-        HORIZON_LENGTH_REL + 0.02, -0.04, HORIZON_DASH_NUM + 2
-    };
-    glGenBuffers(1, &(d->vbo));
-    glBindBuffer(GL_ARRAY_BUFFER, d->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_DYNAMIC_DRAW);
-
-    return d;
+    GLfloat line[8] = { x0, y0, s0, 0, x1, y1, s1, 0 };
+    memcpy(array, line, sizeof(line));
+    return array + 8;
 }
 
-static drawable_t *horizon_alt_create(graphics_t *g, uint8_t color[4])
+static drawable_t *mesh_create(hud_t *hud, uint8_t color[4])
 {
-    struct _drawable *d = malloc(sizeof(struct _drawable));
+    graphics_t *g = hud->g;
+    struct _drawable *d = calloc(1, sizeof(struct _drawable));
     assert(d != 0);
 
     d->type = DRAWABLE_BASE;
+    d->g = g;
     d->color[0] = color[0] / 255.0;
     d->color[1] = color[1] / 255.0;
     d->color[2] = color[2] / 255.0;
@@ -113,13 +116,13 @@ static drawable_t *horizon_alt_create(graphics_t *g, uint8_t color[4])
     d->mask[1] = 0;
     d->mask[2] = 0;
     d->mask[3] = color[3] / 255.0;
-    d->num = 6;
     d->mode = GL_LINES;
+    d->shader = SHADER_RGBA;
 
-    // Generate texture
+    // Generate texture, dashes alternate both texels, solid lines sample only the opaque one
     GLchar buffer[] = { 0xFF, 0x00 };
     glGenTextures(1, &(d->tex));
-    glBindTexture(GL_TEXTURE_2D, d->tex);
+    state_bind_texture(g, 0, d->tex);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, sizeof(buffer), 1, 0, GL_ALPHA, GL_UNSIGNED_BYTE, buffer);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -127,135 +130,116 @@ static drawable_t *horizon_alt_create(graphics_t *g, uint8_t color[4])
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-    // Generate geometry
-    GLfloat array[] =
-    {
-        0, 0, 0, 0,
-        0, -0.2, 10, 0,
-        0, 0, 0, 0,
-        0.05, -0.1, 5, 0,
-        0, 0, 0, 0,
-        -0.05, -0.1, 5, 0
-    };
-
-    glGenBuffers(1, &(d->vbo));
-    glBindBuffer(GL_ARRAY_BUFFER, d->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_DYNAMIC_DRAW);
-
-    return d;
-}
-
-static drawable_t *compass_create(graphics_t *g, uint8_t color[4], float hfov)
-{
-    struct _drawable *d = malloc(sizeof(struct _drawable));
-    assert(d != 0);
-
-    d->type = DRAWABLE_BASE;
-    d->color[0] = color[0] / 255.0;
-    d->color[1] = color[1] / 255.0;
-    d->color[2] = color[2] / 255.0;
-    d->color[3] = color[3] / 255.0;
-    d->mask[0] = 0;
-    d->mask[1] = 0;
-    d->mask[2] = 0;
-    d->mask[3] = 0;
-    d->num = 2 + 2 * COMPASS_STEP_NUM;
-    d->mode = GL_LINES;
+    // Compass tape continues past the full turn by half of the field of view on both sides
+    hud->compass_min = -(int)ceilf(hud->hfov / 2 * COMPASS_STEP_NUM / (2 * M_PI)) - 1;
+    hud->compass_max = COMPASS_STEP_NUM - hud->compass_min;
 
-    // Generate texture
-    glGenTextures(1, &(d->tex));
+    // Generate geometry, strips and loops are split to segments
+    drawable_reserve(d, 6 + 6 + 6 + 2 * CIRCLE_DIV + 4 * (hud->compass_max - hud->compass_min + 1));
+    GLfloat *array = d->vertices;
+    int i;
 
-    // Generate geometry
-    GLfloat array[4 * (2 + 2 * COMPASS_STEP_NUM)] =
+    // Horizon line with dashed middle part
+    hud->parts[PART_HORIZON] = (array - d->vertices) / 4;
+    array = mesh_line(array, -HORIZON_LENGTH_REL - 0.02, -0.04, -2, -HORIZON_LENGTH_REL, 0, 0);
+    array = mesh_line(array, -HORIZON_LENGTH_REL, 0, 0, HORIZON_LENGTH_REL, 0, HORIZON_DASH_NUM);
+    array = mesh_line(array, HORIZON_LENGTH_REL, 0, HORIZON_DASH_NUM, HORIZON_LENGTH_REL + 0.02, -0.04, HORIZON_DASH_NUM + 2);
+
+    // Arrow pointing to the horizon out of view
+    hud->parts[PART_HORIZON_ALT] = (array - d->vertices) / 4;
+    array = mesh_line(array, 0, 0, 0, 0, -0.2, 10);
+    array = mesh_line(array, 0, 0, 0, 0.05, -0.1, 5);
+    array = mesh_line(array, 0, 0, 0, -0.05, -0.1, 5);
+
+    // Track marker triangle
+    hud->parts[PART_TRACK_MARKER] = (array - d->vertices) / 4;
+    float x[3] = { 0, -MARKER_SIZE / (float)g->width, MARKER_SIZE / (float)g->width };
+    float y[3] = { 0, MARKER_SIZE / (float)g->height * 2, MARKER_SIZE / (float)g->height * 2 };
+    for(i = 0; i < 3; i++) array = mesh_line(array, x[i], y[i], MESH_SOLID, x[(i + 1) % 3], y[(i + 1) % 3], MESH_SOLID);
+
+    // Bearing marker circle
+    hud->parts[PART_BEARING_MARKER] = (array - d->vertices) / 4;
+    for(i = 0; i < CIRCLE_DIV; i++)
     {
-        0, 0, 0, 0,
-        4 * M_PI / hfov, 0, 0, 0
-    };
+        float a0 = i * 2 * M_PI / CIRCLE_DIV, a1 = ((i + 1) % CIRCLE_DIV) * 2 * M_PI / CIRCLE_DIV;
+        array = mesh_line(array,
+            COMPASS_HEIGHT / (float)g->width * cosf(a0), -COMPASS_HEIGHT / (float)g->height + COMPASS_HEIGHT / (float)g->height * sinf(a0), MESH_SOLID,
+            COMPASS_HEIGHT / (float)g->width * cosf(a1), -COMPASS_HEIGHT / (float)g->height + COMPASS_HEIGHT / (float)g->height * sinf(a1), MESH_SOLID);
+    }
 
-    int i;
-    float f;
-    for(f = 0, i = 8; f < COMPASS_STEP_NUM; f++, i += 8)
+    // Compass tape, each step is a tick and a segment to the next one
+    hud->parts[PART_COMPASS] = (array - d->vertices) / 4;
+    for(i = hud->compass_min; i <= hud->compass_max; i++)
     {
-        array[i + 4] = array[i] = f * 4 * M_PI / COMPASS_STEP_NUM / hfov;
-        array[i + 5] = -COMPASS_HEIGHT / (float)g->height * 2;
+        float x0 = i * 4 * M_PI / COMPASS_STEP_NUM / hud->hfov, x1 = (i + 1) * 4 * M_PI / COMPASS_STEP_NUM / hud->hfov;
+        array = mesh_line(array, x0, 0, MESH_SOLID, x0, -COMPASS_HEIGHT / (float)g->height * 2, MESH_SOLID);
+        array = mesh_line(array, x0, 0, MESH_SOLID, x1, 0, MESH_SOLID);
     }
-    glGenBuffers(1, &(d->vbo));
-    glBindBuffer(GL_ARRAY_BUFFER, d->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_DYNAMIC_DRAW);
 
+    hud->parts[PART_NUM] = d->num = (array - d->vertices) / 4;
     return d;
 }
 
-static drawable_t *marker1_create(graphics_t *g, uint8_t color[4])
+/* Draws part of the mesh */
+static void mesh_draw(hud_t *hud, enum mesh_part part, int x, int y, float rotation)
 {
-    struct _drawable *d = malloc(sizeof(struct _drawable));
-    assert(d != 0);
-
-    d->type = DRAWABLE_BASE;
-    d->color[0] = color[0] / 255.0;
-    d->color[1] = color[1] / 255.0;
-    d->color[2] = color[2] / 255.0;
-    d->color[3] = color[3] / 255.0;
-    d->mask[0] = 0;
-    d->mask[1] = 0;
-    d->mask[2] = 0;
-    d->mask[3] = 0;
-    d->num = 3;
-    d->mode = GL_LINE_LOOP;
-
-    // Generate texture
-    glGenTextures(1, &(d->tex));
-
-    // Generate geometry
-    GLfloat array[] =
-    {
-        0, 0, 0, 0,
-        -MARKER_SIZE / (float)g->width, MARKER_SIZE / (float)g->height * 2, 0, 0,
-        MARKER_SIZE / (float)g->width, MARKER_SIZE / (float)g->height * 2, 0, 0
-    };
-
-    glGenBuffers(1, &(d->vbo));
-    glBindBuffer(GL_ARRAY_BUFFER, d->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_DYNAMIC_DRAW);
-
-    return d;
+    hud->g->stats.draws++;
+    batch_add(hud->g, hud->mesh, hud->parts[part], hud->parts[part + 1] - hud->parts[part], x, y, 1, rotation);
 }
 
-static drawable_t *marker2_create(graphics_t *g, uint8_t color[4])
+static drawable_t *layer_create(graphics_t *g, GLuint *fbo)
 {
-    struct _drawable *d = malloc(sizeof(struct _drawable));
+    struct _drawable *d = calloc(1, sizeof(struct _drawable));
     assert(d != 0);
 
-    d->type = DRAWABLE_BASE;
-    d->color[0] = color[0] / 255.0;
-    d->color[1] = color[1] / 255.0;
-    d->color[2] = color[2] / 255.0;
-    d->color[3] = color[3] / 255.0;
-    d->mask[0] = 0;
-    d->mask[1] = 0;
-    d->mask[2] = 0;
-    d->mask[3] = 0;
-    d->num = CIRCLE_DIV;
-    d->mode = GL_LINE_LOOP;
+    d->type = DRAWABLE_LAYER;
+    d->g = g;
+    d->mask[0] = 1;
+    d->mask[1] = 1;
+    d->mask[2] = 1;
+    d->mask[3] = 1;
+    d->num = 6;
+    d->mode = GL_TRIANGLES;
+    d->shader = SHADER_RGBA;
 
-    // Generate texture
+    // Generate texture of the frame size
     glGenTextures(1, &(d->tex));
+    state_bind_texture(g, 0, d->tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, g->width, g->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-    // Generate geometry
-    GLfloat array[4 * CIRCLE_DIV];
-    int i;
-    float f;
-    for(i = 0, f = 0; f < CIRCLE_DIV; f++, i += 4)
+    // Attach it to framebuffer
+    glGenFramebuffers(1, fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, d->tex, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if(status != GL_FRAMEBUFFER_COMPLETE)
     {
-        array[i + 0] = COMPASS_HEIGHT / (float)g->width * cosf(f * 2 * M_PI / CIRCLE_DIV);
-        array[i + 1] = -COMPASS_HEIGHT / (float)g->height + COMPASS_HEIGHT / (float)g->height * sinf(f * 2 * M_PI / CIRCLE_DIV);
-        array[i + 2] = 0;
-        array[i + 3] = 0;
+        WARN("Framebuffer incomplete (0x%x)", status);
+        glDeleteFramebuffers(1, fbo);
+        *fbo = 0;
+        state_delete_textures(g, 1, &d->tex);
+        free(d);
+        return NULL;
     }
 
+    // Generate geometry covering the frame, texture rows are bottom-up
+    GLfloat array[] =
+    {
+        0, 0, 0, 1,
+        2, 0, 1, 1,
+        0, -2, 0, 0,
+        2, 0, 1, 1,
+        0, -2, 0, 0,
+        2, -2, 1, 0
+    };
     glGenBuffers(1, &(d->vbo));
-    glBindBuffer(GL_ARRAY_BUFFER, d->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_DYNAMIC_DRAW);
+    state_bind_buffer(g, d->vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_STATIC_DRAW);
 
     return d;
 }
@@ -274,19 +258,18 @@ hud_t *graphics_hud_create(graphics_t *g, atlas_t *atlas, uint8_t color[4], uint
     hud->hfov = hfov;
     hud->vfov = vfov;
     hud->font_size = font_size;
-    hud->horizon_line = horizon_create(g, color);
-    hud->horizon_alt = horizon_alt_create(g, color);
-    hud->compass_lines = compass_create(g, color, hfov);
-    hud->track_marker = marker1_create(g, color);
-    hud->bearing_marker = marker2_create(g, color);
-    hud->speed_label = graphics_label_create(g, atlas, ANCHOR_LEFT_TOP);
-    hud->altitude_label = graphics_label_create(g, atlas, ANCHOR_RIGHT_TOP);
-    hud->waypoint_label = graphics_label_create(g, atlas, ANCHOR_CENTER_TOP);
+    hud->mesh = mesh_create(hud, color);
+    hud->speed_label = graphics_readout_create(g, atlas, ANCHOR_LEFT_TOP, 0, " km/h");
+    hud->altitude_label = graphics_readout_create(g, atlas, ANCHOR_RIGHT_TOP, 0, " m");
+    hud->waypoint_label = graphics_readout_create(g, atlas, ANCHOR_CENTER_TOP, 1, " km");
     if(!hud->speed_label || !hud->altitude_label || !hud->waypoint_label)
     {
         WARN("Cannot create labels");
         goto error;
     }
+    graphics_label_set_size(hud->speed_label, font_size);
+    graphics_label_set_size(hud->altitude_label, font_size);
+    graphics_label_set_size(hud->waypoint_label, font_size);
     graphics_label_set_color(hud->speed_label, color);
     graphics_label_set_color(hud->altitude_label, color);
     graphics_label_set_color(hud->waypoint_label, color);
@@ -302,18 +285,21 @@ hud_t *graphics_hud_create(graphics_t *g, atlas_t *atlas, uint8_t color[4], uint
             while(--i >= 0) graphics_drawable_free(hud->compass_labels[i]);
             goto error;
         }
+        graphics_label_set_size(hud->compass_labels[i], font_size);
         graphics_label_set_text(hud->compass_labels[i], str);
         graphics_label_set_color(hud->compass_labels[i], color);
     }
 
+    // HUD is drawn directly if render target is not available
+    if(!(hud->layer = layer_create(g, &hud->fbo)))
+    {
+        WARN("Cannot create HUD layer, drawing directly");
+    }
+
     return hud;
 
 error:
-    if(hud->horizon_line) graphics_drawable_free(hud->horizon_line);
-    if(hud->horizon_alt) graphics_drawable_free(hud->horizon_alt);
-    if(hud->compass_lines) graphics_drawable_free(hud->compass_lines);
-    if(hud->track_marker) graphics_drawable_free(hud->track_marker);
-    if(hud->bearing_marker) graphics_drawable_free(hud->bearing_marker);
+    if(hud->mesh) graphics_drawable_free(hud->mesh);
     if(hud->speed_label) graphics_drawable_free(hud->speed_label);
     if(hud->altitude_label) graphics_drawable_free(hud->altitude_label);
     if(hud->waypoint_label) graphics_drawable_free(hud->waypoint_label);
@@ -321,23 +307,36 @@ error:
     return NULL;
 }
 
-void graphics_hud_draw(hud_t *hud, float attitude[3], float speed, float altitude, float track, float bearing, float distance, const char *waypoint)
+/* Wraps angle to (-pi, pi) */
+static float angle_wrap(float angle)
 {
-    DEBUG("graphics_hud_draw()");
-    assert(hud != 0);
-    assert(attitude != 0);
-    assert(waypoint != 0);
+    angle = angle < M_PI ? angle : angle - 2 * M_PI;
+    return angle > -M_PI ? angle : angle + 2 * M_PI;
+}
+
+/* Clamps angle to the field of view */
+static float angle_clamp(float angle, float fov)
+{
+    if(angle < fov / -2.0) return fov / -2.0;
+    if(angle > fov / 2.0) return fov / 2.0;
+    return angle;
+}
 
+static void hud_compose(hud_t *hud, float attitude[3], float speed, float altitude, float track, float bearing, float distance, const char *waypoint)
+{
     const char *wpt_name = waypoint[0] ? waypoint : "???";
 
-    // Print labels
+    // Update readouts, waypoint name is laid out only when it changes
+    PROFILE_BEGIN(HUD_TEXT);
     char str[32];
-    snprintf(str, sizeof(str), "%.0f km/h", speed);
-    graphics_label_set_text(hud->speed_label, str);
-    snprintf(str, sizeof(str), "%.0f m", altitude);
-    graphics_label_set_text(hud->altitude_label, str);
-    snprintf(str, sizeof(str), "%s, %.1f km", wpt_name, distance);
+    size_t len = strnlen(wpt_name, sizeof(str) - 3);
+    memcpy(str, wpt_name, len);
+    strcpy(str + len, ", ");
     graphics_label_set_text(hud->waypoint_label, str);
+    graphics_readout_set_value(hud->speed_label, speed);
+    graphics_readout_set_value(hud->altitude_label, altitude);
+    graphics_readout_set_value(hud->waypoint_label, distance);
+    PROFILE_END(HUD_TEXT);
 
     float hangle, vangle;
 
@@ -347,47 +346,107 @@ void graphics_hud_draw(hud_t *hud, float attitude[3], float speed, float altitud
     graphics_draw(hud->g, hud->altitude_label, hud->g->width - 10, 10, 1, 0);
 
     // Draw horizon line
-    vangle = -attitude[1];
-    vangle = vangle < M_PI ? vangle : vangle - 2 * M_PI;
-    vangle = vangle > -M_PI ? vangle : vangle + 2 * M_PI;
+    vangle = angle_wrap(-attitude[1]);
     if(vangle < hud->vfov / -2.0)
-        graphics_draw(hud->g, hud->horizon_alt, hud->g->width / 2, 100, 1, 0);
+        mesh_draw(hud, PART_HORIZON_ALT, hud->g->width / 2, 100, 0);
     else if(vangle > hud->vfov / 2.0)
-        graphics_draw(hud->g, hud->horizon_alt, hud->g->width / 2, (float)hud->g->height - 100, 1, M_PI);
+        mesh_draw(hud, PART_HORIZON_ALT, hud->g->width / 2, (float)hud->g->height - 100, M_PI);
     else
-        graphics_draw(hud->g, hud->horizon_line, hud->g->width / 2, (float)hud->g->height / 2 + (float)hud->g->height * vangle / hud->vfov, 1, -attitude[0]);
-
-    // Draw compass lines
-    graphics_draw(hud->g, hud->compass_lines, (float)hud->g->width / 2 - (float)hud->g->width * attitude[2] / hud->hfov, hud->g->height - hud->font_size - 10, 1, 0);
-    if(attitude[2] < hud->hfov / 2) graphics_draw(hud->g, hud->compass_lines, (float)hud->g->width / 2 - (float)hud->g->width * (attitude[2] + 2 * M_PI)  / hud->hfov, hud->g->height - hud->font_size - 10, 1, 0);
-    if(attitude[2] > 2 * M_PI - hud->hfov / 2) graphics_draw(hud->g, hud->compass_lines, (float)hud->g->width / 2 - (float)hud->g->width * (attitude[2] - 2 * M_PI) / hud->hfov, hud->g->height - hud->font_size - 10, 1, 0);
+        mesh_draw(hud, PART_HORIZON, hud->g->width / 2, (float)hud->g->height / 2 + (float)hud->g->height * vangle / hud->vfov, -attitude[0]);
+
+    // Draw visible steps of compass tape
+    float heading = attitude[2] - 2 * M_PI * floorf(attitude[2] / (2 * M_PI));
+    int first = floorf((heading - hud->hfov / 2) * COMPASS_STEP_NUM / (2 * M_PI));
+    int last = ceilf((heading + hud->hfov / 2) * COMPASS_STEP_NUM / (2 * M_PI));
+    if(first < hud->compass_min) first = hud->compass_min;
+    if(last > hud->compass_max) last = hud->compass_max;
+    hud->g->stats.draws++;
+    batch_add(hud->g, hud->mesh, hud->parts[PART_COMPASS] + (first - hud->compass_min) * 4, (last - first + 1) * 4,
+              (float)hud->g->width / 2 - (float)hud->g->width * heading / hud->hfov, hud->g->height - hud->font_size - 10, 1, 0);
 
     // Draw compass labels
     int i;
     for(i = 0; i < COMPASS_LABEL_NUM; i++)
     {
-        hangle = attitude[2] - i * 2 * M_PI / COMPASS_LABEL_NUM;
-        hangle = hangle < M_PI ? hangle : hangle - 2 * M_PI;
-        hangle = hangle > -M_PI ? hangle : hangle + 2 * M_PI;
+        hangle = angle_wrap(attitude[2] - i * 2 * M_PI / COMPASS_LABEL_NUM);
         if((hangle < hud->hfov / -2.0) || (hangle > hud->hfov / 2.0)) continue;
         graphics_draw(hud->g, hud->compass_labels[i], (float)hud->g->width / 2 - (float)hud->g->width * hangle / hud->hfov, hud->g->height - 3, 1, 0);
     }
 
     // Draw track marker
-    hangle = track - attitude[2];
-    hangle = hangle < M_PI ? hangle : hangle - 2 * M_PI;
-    hangle = hangle > -M_PI ? hangle : hangle + 2 * M_PI;
-    if(hangle < hud->hfov / -2.0) hangle = hud->hfov / -2.0;
-    if(hangle > hud->hfov / 2.0) hangle = hud->hfov / 2.0;
-    graphics_draw(hud->g, hud->track_marker, (float)hud->g->width / 2 + (float)hud->g->width * hangle / hud->hfov, hud->g->height - hud->font_size - 12, 1, 0);
+    hangle = angle_clamp(angle_wrap(track - attitude[2]), hud->hfov);
+    mesh_draw(hud, PART_TRACK_MARKER, (float)hud->g->width / 2 + (float)hud->g->width * hangle / hud->hfov, hud->g->height - hud->font_size - 12, 0);
 
     // Draw bearing marker
-    hangle = bearing - attitude[2];
-    hangle = hangle < M_PI ? hangle : hangle - 2 * M_PI;
-    hangle = hangle > -M_PI ? hangle : hangle + 2 * M_PI;
-    if(hangle < hud->hfov / -2.0) hangle = hud->hfov / -2.0;
-    if(hangle > hud->hfov / 2.0) hangle = hud->hfov / 2.0;
-    graphics_draw(hud->g, hud->bearing_marker, (float)hud->g->width / 2 + (float)hud->g->width * hangle / hud->hfov, hud->g->height - hud->font_size - 10, 1, 0);
+    hangle = angle_clamp(angle_wrap(bearing - attitude[2]), hud->hfov);
+    mesh_draw(hud, PART_BEARING_MARKER, (float)hud->g->width / 2 + (float)hud->g->width * hangle / hud->hfov, hud->g->height - hud->font_size - 10, 0);
+}
+
+void graphics_hud_draw(hud_t *hud, float attitude[3], float speed, float altitude, float track, float bearing, float distance, const char *waypoint)
+{
+    DEBUG("graphics_hud_draw()");
+    assert(hud != 0);
+    assert(attitude != 0);
+    assert(waypoint != 0);
+
+    graphics_t *g = hud->g;
+    if(!hud->layer)
+    {
+        hud_compose(hud, attitude, speed, altitude, track, bearing, distance, waypoint);
+        return;
+    }
+
+    // Quantize values as they are displayed, moving elements by a pixel at the frame edge
+    struct hud_key key;
+    memset(&key, 0, sizeof(key));
+    key.speed = lrintf(speed);
+    key.altitude = lrintf(altitude);
+    key.distance = lrintf(distance * 10);
+    strncpy(key.waypoint, waypoint, sizeof(key.waypoint) - 1);
+
+    float vangle = angle_wrap(-attitude[1]);
+    key.horizon = (vangle < hud->vfov / -2.0) ? -1 : (vangle > hud->vfov / 2.0) ? 1 : 0;
+    key.pitch = key.horizon ? 0 : lrintf((float)g->height * vangle / hud->vfov);
+    key.roll = key.horizon ? 0 : lrintf(attitude[0] * (float)g->width * HORIZON_LENGTH_REL / 2);
+    key.heading = lrintf((float)g->width * attitude[2] / hud->hfov);
+    key.track = lrintf((float)g->width * angle_clamp(angle_wrap(track - attitude[2]), hud->hfov) / hud->hfov);
+    key.bearing = lrintf((float)g->width * angle_clamp(angle_wrap(bearing - attitude[2]), hud->hfov) / hud->hfov);
+
+    // Draw pending list to the frame first, so it stays under the layer either way
+    batch_flush(g);
+
+    if(hud->valid && (memcmp(&key, &hud->key, sizeof(key)) == 0))
+    {
+        hud->stats.hits++;
+    }
+    else
+    {
+        // Redraw HUD to its target, colors are multiplied by alpha
+        glBindFramebuffer(GL_FRAMEBUFFER, hud->fbo);
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT);
+        hud_compose(hud, attitude, speed, altitude, track, bearing, distance, waypoint);
+        batch_flush(g);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        hud->key = key;
+        hud->valid = 1;
+        hud->stats.renders++;
+    }
+
+    // Composite the layer
+    graphics_draw(g, hud->layer, 0, 0, 1, 0);
+}
+
+void graphics_hud_get_stats(hud_t *hud, struct hud_stats *stats)
+{
+    DEBUG("graphics_hud_get_stats()");
+    assert(hud != 0);
+    assert(stats != 0);
+
+    *stats = hud->stats;
 }
 
 void graphics_hud_free(hud_t *hud)
@@ -395,13 +454,17 @@ void graphics_hud_free(hud_t *hud)
     DEBUG("graphics_hud_free()");
     assert(hud != 0);
 
+    INFO("HUD layer rendered %u times, reused %u times (%.1f%% hit rate)", hud->stats.renders, hud->stats.hits,
+         (hud->stats.renders + hud->stats.hits) ? 100.0 * hud->stats.hits / (hud->stats.renders + hud->stats.hits) : 0);
+    if(hud->layer)
+    {
+        glDeleteFramebuffers(1, &hud->fbo);
+        graphics_drawable_free(hud->layer);
+    }
+
     int i;
     for(i = 0; i < COMPASS_LABEL_NUM; i++) graphics_drawable_free(hud->compass_labels[i]);
-    graphics_drawable_free(hud->compass_lines);
-    graphics_drawable_free(hud->track_marker);
-    graphics_drawable_free(hud->bearing_marker);
-    graphics_drawable_free(hud->horizon_line);
-    graphics_drawable_free(hud->horizon_alt);
+    graphics_drawable_free(hud->mesh);
     graphics_drawable_free(hud->speed_label);
     graphics_drawable_free(hud->altitude_label);
     graphics_drawable_free(hud->waypoint_label);
@@ -23,11 +23,82 @@
 #error You are trying to include an internal graphics header. Please include `graphics.h`
 #else
 
+#include <stdio.h>
+#include <time.h>
+
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 
 //! @cond
 
+/* Pixel unpack buffer target, available since GLES 3.0 */
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+
+/* Vertex attribute locations shared by all shader programs */
+#define ATTR_COORD 0
+#define ATTR_COLOR 1
+#define ATTR_MASK 2
+
+/* Texture units used by shader programs */
+#define TEXTURE_UNITS 3
+
+/* Shadowed state value not known */
+#define STATE_UNKNOWN ((GLuint)-1)
+
+/* Frames kept for timing percentiles */
+#define TIMING_RECORDS 512
+
+/* Batched vertex layout, position and texture coordinates followed by color and mask */
+#define BATCH_STRIDE 12
+
+/* Shader program variants */
+enum shader_types
+{
+    SHADER_RGBA = 0,
+    SHADER_YUYV,
+    SHADER_NV12,
+    SHADER_I420,
+    SHADER_NUM
+};
+
+struct shader
+{
+    /* GLSL fragment shader, program and uniforms */
+    GLuint frag, prog;
+    GLint uni_offset, uni_scale, uni_rot, uni_tex, uni_planes[2], uni_texsize, uni_color, uni_mask;
+
+    /* Last uniform values set, zero is the initial value of linked program */
+    GLfloat offset[2], scale[2], rot[1], texsize[2], color[4], mask[4];
+};
+
+struct state
+{
+    /* Current program, array buffer, active texture unit and textures bound to units */
+    GLuint prog, vbo, unit, tex[TEXTURE_UNITS];
+
+    /* Array buffer and vertex stride the attribute pointers were set for */
+    GLuint pointer_vbo;
+    GLsizei pointer_stride;
+};
+
+struct batch
+{
+    /* Texture, drawing mode, vertex range and submission order */
+    GLuint tex, first, count, order;
+    GLenum mode;
+
+    /* Texture is a distance field */
+    GLboolean sdf;
+
+    /* Current height of a growing texture and the height coordinates were normalized to, NULL for fixed textures */
+    const GLuint *tex_height;
+    GLuint height;
+};
+
 struct _graphics
 {
     /* EGL surface and its size */
@@ -36,26 +107,111 @@ struct _graphics
     EGLContext context;
     EGLint width, height;
 
-    /* GLSL shader program and attributes */
-    GLuint vert, frag, prog;
-    GLint attr_coord, uni_offset, uni_scale, uni_rot, uni_tex, uni_color, uni_mask;
+    /* GLSL vertex shader and program variants */
+    GLuint vert;
+    struct shader shaders[SHADER_NUM];
+
+    /* Shadowed OpenGL state, redundant calls are skipped */
+    struct state state;
+
+    /* DMABUF import extension, NULL if not supported */
+    PFNEGLCREATEIMAGEKHRPROC create_image;
+    PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture;
+
+    /* Pixel unpack buffers are supported (GLES 3.0), they are written through mapping */
+    GLboolean unpack_buffer;
+    PFNGLMAPBUFFERRANGEEXTPROC map_buffer_range;
+    PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+
+    /* Program binary extension, NULL if not supported or cache is disabled */
+    PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+    PFNGLPROGRAMBINARYOESPROC program_binary;
+    uint32_t programs_loaded, programs_compiled;
+
+    /* Frame pacing timer, swap durations and present intervals of recent frames in milliseconds */
+    int pacer;
+    float swap_times[TIMING_RECORDS], present_times[TIMING_RECORDS];
+    uint32_t timing_num;
+    struct timespec last_present;
+
+    /* Configuration, raw readback stream and readback buffer */
+    struct graphics_config config;
+    FILE *readback;
+    uint8_t *pixels;
+
+    /* Draw list collected during the frame, its GLSL programs and streamed vertex buffer */
+    GLuint batch_vert, batch_frag, batch_prog, sdf_frag, sdf_prog, batch_vbo;
+    struct batch *batches;
+    GLuint batch_num, batch_max;
+    GLfloat *vertices, *sorted;
+    GLuint vertex_num, vertex_max, batch_capacity;
+
+    /* Draw calls, label layouts and vertex bytes uploaded in the current frame */
+    uint32_t draw_calls, frame_layouts, frame_bytes;
+
+    /* Statistics */
+    struct graphics_stats stats;
 };
 
 struct _drawable
 {
-    // Drawable type
-    enum { DRAWABLE_BASE, DRAWABLE_LABEL, DRAWABLE_IMAGE } type;
+    // Drawable type, layers hold premultiplied render target of the frame size
+    enum { DRAWABLE_BASE, DRAWABLE_LABEL, DRAWABLE_IMAGE, DRAWABLE_LAYER } type;
+
+    // Graphics object the drawable belongs to
+    struct _graphics *g;
 
     // Vertex buffer, its length and texture
     GLuint vbo, num, tex;
 
+    // Vertex copy for batched drawing and its capacity
+    GLfloat *vertices;
+    GLuint capacity;
+
     // Drawing mode (lines / triangles)
     GLenum mode;
 
+    // Distance field edge smoothing at unit scale, zero for coverage textures
+    GLfloat smoothing;
+
+    // Shader program variant
+    enum shader_types shader;
+
     // Colors
     GLfloat mask[4], color[4];
 };
 
+/* State cache, these replace the respective OpenGL calls */
+void state_use_program(struct _graphics *g, GLuint prog);
+void state_bind_texture(struct _graphics *g, GLuint unit, GLuint tex);
+void state_bind_buffer(struct _graphics *g, GLuint vbo);
+void state_attrib_pointer(struct _graphics *g, GLsizei stride);
+void state_uniform(struct _graphics *g, GLint location, GLfloat *shadow, const GLfloat *value, GLsizei size);
+void state_delete_textures(struct _graphics *g, GLsizei num, const GLuint *textures);
+void state_delete_buffer(struct _graphics *g, GLuint vbo);
+
+/* FNV-1a hash of cache keys */
+#define HASH_INIT 0xcbf29ce484222325ULL
+uint64_t hash_data(uint64_t h, const void *data, size_t length);
+
+/* Grows vertex copy of a batched drawable, sets its vertices */
+void drawable_reserve(struct _drawable *d, GLuint num);
+void drawable_set_vertices(struct _drawable *d, const GLfloat *array, GLuint num);
+
+/* Recalculates label geometry if the atlas texture was resized, releases label text */
+void label_revalidate(struct _drawable *d);
+void label_release(struct _drawable *d);
+
+/* Gets current height of the label atlas texture, it grows as glyphs are added */
+const GLuint *label_texture_height(struct _drawable *d);
+
+/* Collects vertex range of a drawable to the draw list, ranges of strips and loops must cover the whole drawable */
+void batch_add(struct _graphics *g, struct _drawable *d, GLuint first, GLuint count, int x, int y, float scale, float rotation);
+
+/* Draws all drawables collected in the draw list */
+void batch_flush(struct _graphics *g);
+
 //! @endcond
 
 #endif /* GRAPHICS_PRIV_H */
@@ -15,7 +15,12 @@
  * <http://www.gnu.org/licenses>
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "debug.h"
 #include "graphics.h"
@@ -26,130 +31,534 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_MODULE_H
+
+/* Distance field rendering is available since FreeType 2.11 */
+#if (FREETYPE_MAJOR > 2) || ((FREETYPE_MAJOR == 2) && (FREETYPE_MINOR >= 11))
+#define ATLAS_SDF_SUPPORTED
+#endif
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
-/* Atlas character mapping, using characters 32 - 255 of ISO-8859-1 / Unicode */
-#define ATLAS_MAP_OFFSET 32
-#define ATLAS_MAP_LENGTH (256 - ATLAS_MAP_OFFSET)
+/* Atlas texture width and initial height, height doubles as glyphs are added */
+#define ATLAS_TEXTURE_WIDTH_MIN 256
+#define ATLAS_TEXTURE_HEIGHT_MIN 64
+
+/* Distance field atlas is rasterized at this size, with distances up to spread pixels around outlines */
+#define ATLAS_SDF_SIZE 32
+#define ATLAS_SDF_SPREAD 4
+
+/* Atlas cache file identification, version is bumped with any change of the format */
+#define ATLAS_CACHE_MAGIC "ATLS"
+#define ATLAS_CACHE_VERSION ((FREETYPE_MAJOR * 10000 + FREETYPE_MINOR * 100 + FREETYPE_PATCH) * 100 + 1)
+
+/* Initial number of glyph slots */
+#define ATLAS_GLYPHS_MIN 128
 
-/* Atlas texture size */
-#define ATLAS_TEXTURE_WIDTH 512
-#define ATLAS_TEXTURE_HEIGHT 512
+/* Code point shown for malformed UTF-8 */
+#define REPLACEMENT_CHARACTER 0xFFFD
+
+/* Readout values are saturated to nine digits, characters include sign, decimal point and terminator */
+#define READOUT_VALUE_MAX 999999999
+#define READOUT_DECIMALS_MAX 6
+#define READOUT_LENGTH 12
 
 struct _drawable_label
 {
     struct _drawable d;
-    graphics_t *g;
     atlas_t *atlas;
     enum anchor_types anchor;
+
+    // Text and atlas generation of the current layout
+    char *text;
+    uint32_t generation;
+
+    // Font size, zero for the atlas size
+    uint32_t size;
+
+    // Numeric readout, NULL for plain labels
+    struct readout *readout;
+};
+
+struct readout
+{
+    char *suffix;
+    uint32_t decimals;
+
+    // Formatted value and its character cells, each holding one quad at the slot vertex
+    char number[READOUT_LENGTH];
+    GLuint slots[READOUT_LENGTH];
+    float cell_x[READOUT_LENGTH];
+
+    // Width of digit cells in atlas pixels, baseline and scale of the current layout
+    float cell;
+    float pos_y, scale_x, scale_y;
+};
+
+struct glyph
+{
+    // Code point, zero for empty slot
+    uint32_t code;
+
+    // Bitmap position in texture, its size and placement in pixels
+    uint16_t x, y, width, height;
+    int16_t left, top;
+    float advance_x, advance_y;
+};
+
+struct shelf
+{
+    uint16_t x, y, height;
+};
+
+/* Atlas cache file starts with header, then follow glyph slots, shelves and bitmap */
+struct atlas_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t glyph_num, glyph_max, shelf_num;
 };
 
 struct _atlas
 {
+    // Font face, opened on first glyph missing in cache
+    char *font;
+    FT_Library ft;
+    FT_Face face;
+
+    // Cache file name, written at release if glyphs were added
+    char cache[256];
+    bool dirty;
+
+    // Font size, size the glyphs are rasterized at and their padding
+    uint32_t size, raster_size, padding;
+    bool sdf;
+
+    // Texture and its copy in memory for resizing
     GLuint texture;
-    struct
+    GLuint width, height, max_height;
+    uint8_t *bitmap;
+
+    // Incremented when texture coordinates are invalidated by resizing
+    uint32_t generation;
+
+    // Rasterized glyphs, open addressing by code point
+    struct glyph *glyphs;
+    uint32_t glyph_num, glyph_max;
+
+    // Rows of packed glyphs
+    struct shelf *shelves;
+    uint32_t shelf_num;
+};
+
+/* Decodes UTF-8 character and advances the pointer, returns zero at the end of text */
+static uint32_t utf8_decode(const uint8_t **text)
+{
+    const uint8_t *pc = *text;
+    uint32_t code;
+    int i, len;
+
+    if(*pc == 0) return 0;
+    else if(*pc < 0x80) { code = *pc; len = 0; }
+    else if((*pc & 0xE0) == 0xC0) { code = *pc & 0x1F; len = 1; }
+    else if((*pc & 0xF0) == 0xE0) { code = *pc & 0x0F; len = 2; }
+    else if((*pc & 0xF8) == 0xF0) { code = *pc & 0x07; len = 3; }
+    else
     {
-        float left, top, width, height;
-        float tex_x, tex_y;
-        float advance_x, advance_y;
+        *text = pc + 1;
+        return REPLACEMENT_CHARACTER;
     }
-    chars[ATLAS_MAP_LENGTH];
-};
 
-atlas_t *graphics_atlas_create(const char *font, uint32_t size)
+    for(i = 1; i <= len; i++)
+    {
+        if((pc[i] & 0xC0) != 0x80)
+        {
+            *text = pc + i;
+            return REPLACEMENT_CHARACTER;
+        }
+        code = (code << 6) | (pc[i] & 0x3F);
+    }
+
+    *text = pc + len + 1;
+    return code ? code : REPLACEMENT_CHARACTER;
+}
+
+/* Uploads atlas rows from memory copy */
+static void atlas_upload(graphics_t *g, atlas_t *atlas, GLuint y, GLuint height, int resize)
 {
-    DEBUG("graphics_atlas_create()");
-    assert(font != 0);
+    state_bind_texture(g, 0, atlas->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if(resize) glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, atlas->width, atlas->height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, atlas->bitmap);
+    else glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, atlas->width, height, GL_ALPHA, GL_UNSIGNED_BYTE, atlas->bitmap + y * atlas->width);
+}
 
-    atlas_t *atlas = malloc(sizeof(struct _atlas));
-    assert(atlas != 0);
+/* Finds space for bitmap on the best fitting shelf, opens new shelf or grows texture if needed */
+static int atlas_pack(graphics_t *g, atlas_t *atlas, GLuint width, GLuint height, uint16_t *x, uint16_t *y)
+{
+    // Glyphs are separated by one pixel
+    width++;
+    height++;
+    if(width > atlas->width) return 0;
 
-    FT_Library ft;
-    FT_Face face;
-    if(FT_Init_FreeType(&ft))
+    int i;
+    struct shelf *best = NULL;
+    for(i = 0; i < atlas->shelf_num; i++)
+    {
+        struct shelf *shelf = &atlas->shelves[i];
+        if((shelf->height >= height) && (shelf->x + width <= atlas->width) && (!best || (shelf->height < best->height))) best = shelf;
+    }
+
+    if(!best)
+    {
+        GLuint top = atlas->shelf_num ? atlas->shelves[atlas->shelf_num - 1].y + atlas->shelves[atlas->shelf_num - 1].height : 0;
+        if(top + height > atlas->height)
+        {
+            GLuint size = atlas->height;
+            while((top + height > size) && (size < atlas->max_height)) size *= 2;
+            if(top + height > size) return 0;
+
+            // Texture coordinates of laid out labels are invalidated
+            atlas->bitmap = realloc(atlas->bitmap, atlas->width * size);
+            assert(atlas->bitmap != 0);
+            memset(atlas->bitmap + atlas->width * atlas->height, 0, atlas->width * (size - atlas->height));
+            atlas->height = size;
+            atlas->generation++;
+            atlas_upload(g, atlas, 0, 0, 1);
+        }
+
+        atlas->shelves = realloc(atlas->shelves, (atlas->shelf_num + 1) * sizeof(struct shelf));
+        assert(atlas->shelves != 0);
+        best = &atlas->shelves[atlas->shelf_num++];
+        best->x = 0;
+        best->y = top;
+        best->height = height;
+    }
+
+    *x = best->x;
+    *y = best->y;
+    best->x += width;
+    return 1;
+}
+
+/* Finds glyph slot of code point */
+static struct glyph *atlas_slot(atlas_t *atlas, uint32_t code)
+{
+    uint32_t i = (code * 2654435761u) & (atlas->glyph_max - 1);
+    while(atlas->glyphs[i].code && (atlas->glyphs[i].code != code)) i = (i + 1) & (atlas->glyph_max - 1);
+    return &atlas->glyphs[i];
+}
+
+/* Opens font face, it is needed only to rasterize glyphs missing in cache */
+static int atlas_open(atlas_t *atlas)
+{
+    if(FT_Init_FreeType(&atlas->ft))
     {
         WARN("Failed to init FreeType");
+        atlas->ft = NULL;
         return 0;
     }
 
-    if(FT_New_Face(ft, font, 0, &face))
+    if(FT_New_Face(atlas->ft, atlas->font, 0, &atlas->face))
     {
-        WARN("Failed to load font `%s`", font);
+        WARN("Failed to load font `%s`", atlas->font);
         goto error;
     }
 
-    if(FT_Select_Charmap(face, FT_ENCODING_UNICODE))
+    if(FT_Select_Charmap(atlas->face, FT_ENCODING_UNICODE))
     {
         WARN("Failed to select charmap");
         goto error;
     }
 
-    if(FT_Set_Pixel_Sizes(face, 0, size))
+    if(FT_Set_Pixel_Sizes(atlas->face, 0, atlas->raster_size))
     {
         WARN("Failed to set font size");
         goto error;
     }
 
-    // Create texture
-    glGenTextures(1, &atlas->texture);
-    glBindTexture(GL_TEXTURE_2D, atlas->texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, ATLAS_TEXTURE_WIDTH, ATLAS_TEXTURE_HEIGHT, 0, GL_ALPHA, GL_UNSIGNED_BYTE, 0);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+#ifdef ATLAS_SDF_SUPPORTED
+    FT_Int spread = ATLAS_SDF_SPREAD;
+    if(atlas->sdf && FT_Property_Set(atlas->ft, "sdf", "spread", &spread))
+    {
+        WARN("Failed to set distance field spread");
+        goto error;
+    }
+#endif
 
-    int row_height = 0;
-    int offset_x = 0;
-    int offset_y = 0;
+    return 1;
 
-    int i;
-    for(i = 0; i < ATLAS_MAP_LENGTH; i++)
+error:
+    FT_Done_FreeType(atlas->ft);
+    atlas->ft = NULL;
+    atlas->face = NULL;
+    return 0;
+}
+
+/* Gets glyph of code point, rasterizing it on first use */
+static struct glyph *atlas_glyph(graphics_t *g, atlas_t *atlas, uint32_t code)
+{
+    struct glyph *glyph = atlas_slot(atlas, code);
+    if(glyph->code) return glyph;
+    if(!atlas->face && !atlas_open(atlas)) return NULL;
+
+    // Keep load factor below one half
+    if((atlas->glyph_num + 1) * 2 > atlas->glyph_max)
     {
-        if(FT_Load_Char(face, i + ATLAS_MAP_OFFSET, FT_LOAD_RENDER))
+        struct glyph *glyphs = atlas->glyphs;
+        uint32_t i, max = atlas->glyph_max;
+        atlas->glyph_max *= 2;
+        atlas->glyphs = calloc(atlas->glyph_max, sizeof(struct glyph));
+        assert(atlas->glyphs != 0);
+        for(i = 0; i < max; i++)
         {
-            WARN("Failed to load character %d", i + ATLAS_MAP_OFFSET);
-            return 0;
+            if(glyphs[i].code) *atlas_slot(atlas, glyphs[i].code) = glyphs[i];
         }
+        free(glyphs);
+        glyph = atlas_slot(atlas, code);
+    }
+
+    // Missing characters are rendered as the undefined glyph of the font
+    if(FT_Load_Char(atlas->face, code, atlas->sdf ? FT_LOAD_DEFAULT : FT_LOAD_RENDER)
+#ifdef ATLAS_SDF_SUPPORTED
+       || (atlas->sdf && FT_Render_Glyph(atlas->face->glyph, FT_RENDER_MODE_SDF))
+#endif
+      )
+    {
+        WARN("Failed to load character %u", code);
+        return NULL;
+    }
 
-        // Start new line if needed
-        if(offset_x + face->glyph->bitmap.width + 1 >= ATLAS_TEXTURE_WIDTH)
+    FT_GlyphSlot slot = atlas->face->glyph;
+    uint16_t x = 0, y = 0;
+    if(slot->bitmap.width && slot->bitmap.rows)
+    {
+        if(!atlas_pack(g, atlas, slot->bitmap.width, slot->bitmap.rows, &x, &y))
         {
-            offset_y += row_height;
-            row_height = 0;
-            offset_x = 0;
+            WARN("Atlas texture full at %u characters", atlas->glyph_num);
+            return NULL;
+        }
 
-            if(offset_y + face->glyph->bitmap.rows + 1 >= ATLAS_TEXTURE_HEIGHT)
-            {
-                WARN("Atlas texture full at %d of %d characters", i, ATLAS_MAP_LENGTH);
-                return 0;
-            }
+        // Copy bitmap and upload affected rows
+        int row;
+        for(row = 0; row < slot->bitmap.rows; row++)
+        {
+            memcpy(atlas->bitmap + (y + row) * atlas->width + x, slot->bitmap.buffer + row * slot->bitmap.pitch, slot->bitmap.width);
         }
+        atlas_upload(g, atlas, y, slot->bitmap.rows, 0);
+    }
 
-        // Load glyph
-        glTexSubImage2D(GL_TEXTURE_2D, 0, offset_x, offset_y, face->glyph->bitmap.width, face->glyph->bitmap.rows,
-                        GL_ALPHA, GL_UNSIGNED_BYTE, face->glyph->bitmap.buffer);
-        atlas->chars[i].advance_x = (face->glyph->advance.x >> 6);
-        atlas->chars[i].advance_y = (face->glyph->advance.y >> 6);
-        atlas->chars[i].width = face->glyph->bitmap.width;
-        atlas->chars[i].height = face->glyph->bitmap.rows;
-        atlas->chars[i].left = face->glyph->bitmap_left;
-        atlas->chars[i].top = face->glyph->bitmap_top;
-        atlas->chars[i].tex_x = offset_x / (float)ATLAS_TEXTURE_WIDTH;
-        atlas->chars[i].tex_y = offset_y / (float)ATLAS_TEXTURE_HEIGHT;
-        row_height = MAX(row_height, face->glyph->bitmap.rows);
-        offset_x += face->glyph->bitmap.width + 1;
+    glyph->code = code;
+    glyph->x = x;
+    glyph->y = y;
+    glyph->width = slot->bitmap.width;
+    glyph->height = slot->bitmap.rows;
+    glyph->left = slot->bitmap_left;
+    glyph->top = slot->bitmap_top;
+    glyph->advance_x = slot->advance.x >> 6;
+    glyph->advance_y = slot->advance.y >> 6;
+    atlas->glyph_num++;
+    atlas->dirty = true;
+    return glyph;
+}
+
+/* Gets cache file name of atlas, keyed by font file contents and rasterization */
+static int atlas_cache_path(atlas_t *atlas, const char *cache)
+{
+    FILE *fp = fopen(atlas->font, "rb");
+    if(!fp)
+    {
+        WARN("Failed to load font `%s`", atlas->font);
+        return 0;
+    }
+
+    uint8_t buffer[4096];
+    size_t len;
+    uint64_t h = HASH_INIT;
+    while((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) h = hash_data(h, buffer, len);
+    fclose(fp);
+
+    uint32_t params[] = { atlas->raster_size, atlas->padding, atlas->sdf };
+    h = hash_data(h, params, sizeof(params));
+    snprintf(atlas->cache, sizeof(atlas->cache), "%s/atlas-%016llx.bin", cache, (unsigned long long)h);
+    return 1;
+}
+
+/* Checks that cached shelves and glyphs lie within the bitmap and the glyph count matches, returns 0 if not */
+static int atlas_cache_check(const struct atlas_header *header, const struct glyph *glyphs, const struct shelf *shelves)
+{
+    uint32_t i, num = 0;
+    for(i = 0; i < header->shelf_num; i++)
+    {
+        if((shelves[i].x > header->width) || (shelves[i].y + shelves[i].height > header->height)) return 0;
+    }
+
+    for(i = 0; i < header->glyph_max; i++)
+    {
+        if(!glyphs[i].code) continue;
+        if((glyphs[i].x + glyphs[i].width > header->width) || (glyphs[i].y + glyphs[i].height > header->height)) return 0;
+        num++;
+    }
+    return num == header->glyph_num;
+}
+
+/* Loads glyphs and bitmap from cache, returns 0 if missing or invalid */
+static int atlas_cache_load(atlas_t *atlas)
+{
+    FILE *fp = fopen(atlas->cache, "rb");
+    if(!fp) return 0;
+
+    // File size must match the header, which also bounds the allocations below
+    struct atlas_header header;
+    long size;
+    if((fread(&header, sizeof(header), 1, fp) != 1) || (memcmp(header.magic, ATLAS_CACHE_MAGIC, 4) != 0) ||
+       (header.version != ATLAS_CACHE_VERSION) || (header.width != atlas->width) ||
+       (header.height < ATLAS_TEXTURE_HEIGHT_MIN) || (header.height > atlas->max_height) || (header.height & (header.height - 1)) ||
+       (header.glyph_max < ATLAS_GLYPHS_MIN) || (header.glyph_max & (header.glyph_max - 1)) || (header.glyph_num * 2 > header.glyph_max) ||
+       (fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) == -1) || (fseek(fp, sizeof(header), SEEK_SET) != 0) ||
+       ((uint64_t)size != sizeof(header) + (uint64_t)header.glyph_max * sizeof(struct glyph) +
+                          (uint64_t)header.shelf_num * sizeof(struct shelf) + (uint64_t)header.width * header.height))
+    {
+        INFO("Atlas cache `%s` not valid", atlas->cache);
+        fclose(fp);
+        return 0;
     }
 
-    INFO("Atlas used %d rows of %d available", offset_y + face->glyph->bitmap.rows + 1, ATLAS_TEXTURE_WIDTH);
-    FT_Done_FreeType(ft);
+    struct glyph *glyphs = malloc(header.glyph_max * sizeof(struct glyph));
+    struct shelf *shelves = malloc(header.shelf_num * sizeof(struct shelf) + 1);
+    uint8_t *bitmap = malloc(header.width * header.height);
+    assert((glyphs != 0) && (shelves != 0) && (bitmap != 0));
+    if((fread(glyphs, sizeof(struct glyph), header.glyph_max, fp) != header.glyph_max) ||
+       (fread(shelves, sizeof(struct shelf), header.shelf_num, fp) != header.shelf_num) ||
+       (fread(bitmap, header.width, header.height, fp) != header.height) ||
+       !atlas_cache_check(&header, glyphs, shelves))
+    {
+        WARN("Invalid atlas cache `%s`", atlas->cache);
+        free(glyphs);
+        free(shelves);
+        free(bitmap);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    free(atlas->glyphs);
+    free(atlas->bitmap);
+    atlas->glyphs = glyphs;
+    atlas->glyph_num = header.glyph_num;
+    atlas->glyph_max = header.glyph_max;
+    atlas->shelves = shelves;
+    atlas->shelf_num = header.shelf_num;
+    atlas->bitmap = bitmap;
+    atlas->height = header.height;
+    return 1;
+}
+
+/* Stores glyphs and bitmap to cache */
+static void atlas_cache_store(atlas_t *atlas)
+{
+    char path[sizeof(atlas->cache) + 4];
+    snprintf(path, sizeof(path), "%s.tmp", atlas->cache);
+
+    struct atlas_header header =
+    {
+        .magic = ATLAS_CACHE_MAGIC,
+        .version = ATLAS_CACHE_VERSION,
+        .width = atlas->width,
+        .height = atlas->height,
+        .glyph_num = atlas->glyph_num,
+        .glyph_max = atlas->glyph_max,
+        .shelf_num = atlas->shelf_num
+    };
+
+    // Write whole file before replacing the old one
+    FILE *fp = fopen(path, "wb");
+    if(!fp)
+    {
+        WARN("Failed to write atlas cache `%s`", atlas->cache);
+        return;
+    }
+
+    int written = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+                  (fwrite(atlas->glyphs, sizeof(struct glyph), atlas->glyph_max, fp) == atlas->glyph_max) &&
+                  (fwrite(atlas->shelves, sizeof(struct shelf), atlas->shelf_num, fp) == atlas->shelf_num) &&
+                  (fwrite(atlas->bitmap, atlas->width, atlas->height, fp) == atlas->height);
+    if((fclose(fp) != 0) || !written || (rename(path, atlas->cache) != 0))
+    {
+        WARN("Failed to write atlas cache `%s`", atlas->cache);
+        unlink(path);
+        return;
+    }
+    INFO("Atlas cache `%s` written with %u glyphs", atlas->cache, atlas->glyph_num);
+}
+
+atlas_t *graphics_atlas_create(const char *font, uint32_t size, bool sdf, const char *cache)
+{
+    DEBUG("graphics_atlas_create()");
+    assert(font != 0);
+
+#ifndef ATLAS_SDF_SUPPORTED
+    if(sdf)
+    {
+        WARN("Distance field atlas requires FreeType 2.11");
+        return NULL;
+    }
+#endif
+
+    atlas_t *atlas = calloc(1, sizeof(struct _atlas));
+    assert(atlas != 0);
+
+    atlas->font = strdup(font);
+    assert(atlas->font != 0);
+    atlas->size = size;
+    atlas->raster_size = sdf ? ATLAS_SDF_SIZE : size;
+    atlas->padding = sdf ? ATLAS_SDF_SPREAD : 0;
+    atlas->sdf = sdf;
+
+    // Texture fits at least eight glyphs per row
+    GLint max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    atlas->width = ATLAS_TEXTURE_WIDTH_MIN;
+    while((atlas->width < (atlas->raster_size + atlas->padding * 2) * 8) && (atlas->width < max_size)) atlas->width *= 2;
+    atlas->height = ATLAS_TEXTURE_HEIGHT_MIN;
+    atlas->max_height = max_size;
+    atlas->bitmap = calloc(atlas->width, atlas->height);
+    assert(atlas->bitmap != 0);
+
+    atlas->glyph_max = ATLAS_GLYPHS_MIN;
+    atlas->glyphs = calloc(atlas->glyph_max, sizeof(struct glyph));
+    assert(atlas->glyphs != 0);
+
+    // Font is opened only if there is no valid cache
+    if(cache)
+    {
+        if(!atlas_cache_path(atlas, cache)) goto error;
+        if((mkdir(cache, 0755) == -1) && (errno != EEXIST)) WARN("Failed to create `%s`", cache);
+        if(atlas_cache_load(atlas)) INFO("Atlas loaded from cache with %u glyphs", atlas->glyph_num);
+    }
+    if(!atlas->glyph_num && !atlas_open(atlas)) goto error;
+
+    // Create texture, keep current binding known to graphics state cache
+    GLint binding;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &binding);
+    glGenTextures(1, &atlas->texture);
+    glBindTexture(GL_TEXTURE_2D, atlas->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, atlas->width, atlas->height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, atlas->bitmap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, binding);
+
     return atlas;
 
 error:
-    FT_Done_FreeType(ft);
+    free(atlas->font);
+    free(atlas->bitmap);
+    free(atlas->glyphs);
+    free(atlas->shelves);
     free(atlas);
     return NULL;
 }
@@ -174,92 +583,197 @@ drawable_t *graphics_label_create(graphics_t *g, atlas_t *atlas, enum anchor_typ
     label->d.color[3] = 0;
     label->d.num = 0;
     label->d.mode = GL_TRIANGLES;
+    label->d.shader = SHADER_RGBA;
 
-    glGenBuffers(1, &label->d.vbo);
+    label->d.vbo = 0;
+    label->d.vertices = NULL;
+    label->d.capacity = 0;
     label->d.tex = atlas->texture;
     label->atlas = atlas;
-    label->g = g;
+    label->d.g = g;
     label->anchor = anchor;
+    label->text = NULL;
+    label->generation = atlas->generation;
+    label->size = 0;
+    label->d.smoothing = 0;
+    label->readout = NULL;
 
     return (drawable_t*)label;
 }
 
-void graphics_label_set_text(drawable_t *d, const char *text)
+/* Writes quad of a glyph at the pen position */
+static void glyph_quad(GLfloat *array, const struct glyph *glyph, const atlas_t *atlas, float pos_x, float pos_y, float scale_x, float scale_y)
 {
-    DEBUG("graphics_label_set_text()");
-    assert(d != 0);
-    assert(text != 0);
-    assert(d->type == DRAWABLE_LABEL);
-    struct _drawable_label *label = (struct _drawable_label*)d;
+    float left = pos_x + glyph->left * scale_x;
+    float bottom = pos_y + glyph->top * scale_y;
+    float width = glyph->width * scale_x;
+    float height = glyph->height * scale_y;
+    float tex_left = glyph->x / (float)atlas->width;
+    float tex_top = glyph->y / (float)atlas->height;
+    float tex_right = (glyph->x + glyph->width) / (float)atlas->width;
+    float tex_bottom = (glyph->y + glyph->height) / (float)atlas->height;
+
+    // Left bottom
+    array[0] = left;
+    array[1] = bottom;
+    array[2] = tex_left;
+    array[3] = tex_top;
+
+    // Right bottom
+    array[4] = left + width;
+    array[5] = bottom;
+    array[6] = tex_right;
+    array[7] = tex_top;
+
+    // Left top
+    array[8] = left;
+    array[9] = bottom - height;
+    array[10] = tex_left;
+    array[11] = tex_bottom;
+
+    // Right bottom
+    array[12] = left + width;
+    array[13] = bottom;
+    array[14] = tex_right;
+    array[15] = tex_top;
+
+    // Left top
+    array[16] = left;
+    array[17] = bottom - height;
+    array[18] = tex_left;
+    array[19] = tex_bottom;
+
+    // Right top
+    array[20] = left + width;
+    array[21] = bottom - height;
+    array[22] = tex_right;
+    array[23] = tex_bottom;
+}
+
+/* Writes quad of a readout character to its cell, digits are centered in cells of fixed width */
+static void readout_quad(struct _drawable_label *label, int slot)
+{
+    struct readout *readout = label->readout;
+    GLfloat *array = label->d.vertices + readout->slots[slot];
+    struct glyph *glyph = atlas_glyph(label->d.g, label->atlas, readout->number[slot]);
+
+    // Empty glyphs keep a degenerate quad
+    if(!glyph || !glyph->width || !glyph->height)
+    {
+        memset(array, 0, 24 * sizeof(GLfloat));
+        return;
+    }
+
+    float pos_x = readout->cell_x[slot];
+    if((readout->number[slot] >= '0') && (readout->number[slot] <= '9')) pos_x += (readout->cell - glyph->advance_x) / 2 * readout->scale_x;
+    glyph_quad(array, glyph, label->atlas, pos_x, readout->pos_y, readout->scale_x, readout->scale_y);
+}
 
-    GLfloat array[strlen(text) * 24];
+/* Calculates label geometry from its text, readout value and suffix follow the text */
+static void label_layout(struct _drawable_label *label)
+{
+    struct readout *readout = label->readout;
+    const char *segments[3] = { label->text, readout ? readout->number : "", readout ? readout->suffix : "" };
+    atlas_t *atlas = label->atlas;
     GLuint num = 0;
 
+    // Glyphs are scaled from their rasterized size
+    float factor = (float)(label->size ? label->size : atlas->size) / atlas->raster_size;
+    float pixel_x = 2.0 / label->d.g->width;
+    float pixel_y = 2.0 / label->d.g->height;
+    float scale_x = pixel_x * factor;
+    float scale_y = pixel_y * factor;
+    float padding_x = atlas->padding * scale_x;
+    float padding_y = atlas->padding * scale_y;
+    label->d.smoothing = atlas->sdf ? 0.25 / ATLAS_SDF_SPREAD / factor : 0;
+
     float row_top = 0, row_bottom = 0;
-    float scale_x = 2.0 / label->g->width;
-    float scale_y = 2.0 / label->g->height;
+    float ink_left = 0, ink_right = 0;
     float pos_x = 0;
     float pos_y = 0;
 
-    // Calculate geometry
-    uint8_t *pc = (uint8_t*)text;
-    for(; *pc; pc++)
-    {
-        uint8_t c = *pc - ATLAS_MAP_OFFSET;
-        if(c >= ATLAS_MAP_LENGTH) continue;
-        float left = pos_x + label->atlas->chars[c].left * scale_x;
-        float bottom = pos_y + label->atlas->chars[c].top * scale_y;
-        float width = label->atlas->chars[c].width * scale_x;
-        float height = label->atlas->chars[c].height * scale_y;
-
-        pos_x += label->atlas->chars[c].advance_x * scale_x;
-        pos_y += label->atlas->chars[c].advance_y * scale_y;
-        if (!width || !height) continue;
-
-        row_top = MIN(row_bottom, bottom - height);
-        row_bottom = MAX(row_top, bottom);
-
-        // Left bottom
-        array[num + 0] = left;
-        array[num + 1] = bottom;
-        array[num + 2] = label->atlas->chars[c].tex_x;
-        array[num + 3] = label->atlas->chars[c].tex_y;
-        num += 4;
-
-        // Right bottom
-        array[num + 0] = left + width;
-        array[num + 1] = bottom;
-        array[num + 2] = label->atlas->chars[c].tex_x + label->atlas->chars[c].width / ATLAS_TEXTURE_WIDTH;
-        array[num + 3] = label->atlas->chars[c].tex_y;
-        num += 4;
-
-        // Left top
-        array[num + 0] = left;
-        array[num + 1] = bottom - height;
-        array[num + 2] = label->atlas->chars[c].tex_x;
-        array[num + 3] = label->atlas->chars[c].tex_y + label->atlas->chars[c].height / ATLAS_TEXTURE_HEIGHT;
-        num += 4;
-
-        // Right bottom
-        array[num + 0] = left + width;
-        array[num + 1] = bottom;
-        array[num + 2] = label->atlas->chars[c].tex_x + label->atlas->chars[c].width / ATLAS_TEXTURE_WIDTH;
-        array[num + 3] = label->atlas->chars[c].tex_y;
-        num += 4;
-
-        // Left top
-        array[num + 0] = left;
-        array[num + 1] = bottom - height;
-        array[num + 2] = label->atlas->chars[c].tex_x;
-        array[num + 3] = label->atlas->chars[c].tex_y + label->atlas->chars[c].height / ATLAS_TEXTURE_HEIGHT;
-        num += 4;
-
-        // Right top
-        array[num + 0] = left + width;
-        array[num + 1] = bottom - height;
-        array[num + 2] = label->atlas->chars[c].tex_x + label->atlas->chars[c].width / ATLAS_TEXTURE_WIDTH;
-        array[num + 3] = label->atlas->chars[c].tex_y + label->atlas->chars[c].height / ATLAS_TEXTURE_HEIGHT;
-        num += 4;
+    // Rasterize missing glyphs first, resizing the texture moves all texture coordinates
+    uint32_t code;
+    const uint8_t *pc;
+    int i, length = 0;
+    for(i = 0; i < 3; i++)
+    {
+        pc = (const uint8_t*)segments[i];
+        while((code = utf8_decode(&pc)))
+        {
+            if(code >= 32) atlas_glyph(label->d.g, atlas, code);
+        }
+        length += strlen(segments[i]);
+    }
+    if(readout)
+    {
+        // Any digit may replace another one in place, cells are as wide as the widest digit
+        readout->cell = 0;
+        for(code = '0'; code <= '9'; code++)
+        {
+            struct glyph *glyph = atlas_glyph(label->d.g, atlas, code);
+            if(glyph) readout->cell = MAX(readout->cell, glyph->advance_x);
+        }
+        atlas_glyph(label->d.g, atlas, '-');
+        atlas_glyph(label->d.g, atlas, '.');
+        readout->scale_x = scale_x;
+        readout->scale_y = scale_y;
+    }
+    label->generation = atlas->generation;
+    label->d.g->frame_layouts++;
+
+    // Calculate geometry in place, there are at most six vertices per byte
+    drawable_reserve(&label->d, length * 6);
+    GLfloat *array = label->d.vertices;
+    bool ink = false;
+    for(i = 0; i < 3; i++)
+    {
+        int slot = 0;
+        pc = (const uint8_t*)segments[i];
+        while((code = utf8_decode(&pc)))
+        {
+            struct glyph *glyph = (code >= 32) ? atlas_glyph(label->d.g, atlas, code) : NULL;
+            float left = pos_x;
+            float advance_x = glyph ? glyph->advance_x : 0;
+
+            // Each character of readout value keeps its quad to be rewritten when the value changes
+            if(i == 1)
+            {
+                readout->slots[slot] = num;
+                readout->cell_x[slot] = pos_x;
+                readout->pos_y = pos_y;
+                readout_quad(label, slot++);
+                num += 24;
+
+                if((code >= '0') && (code <= '9'))
+                {
+                    if(glyph) left += (readout->cell - glyph->advance_x) / 2 * scale_x;
+                    advance_x = readout->cell;
+                }
+            }
+
+            if(glyph && glyph->width && glyph->height)
+            {
+                float bottom = pos_y + glyph->top * scale_y;
+                float height = glyph->height * scale_y;
+
+                // Extents exclude padding of distance field
+                row_top = MIN(row_bottom, bottom - height + padding_y);
+                row_bottom = MAX(row_top, bottom - padding_y);
+                if(!ink) ink_left = left + glyph->left * scale_x + padding_x;
+                ink_right = left + (glyph->left + glyph->width) * scale_x - padding_x;
+                ink = true;
+
+                if(i != 1)
+                {
+                    glyph_quad(array + num, glyph, atlas, left, pos_y, scale_x, scale_y);
+                    num += 24;
+                }
+            }
+
+            pos_x += advance_x * scale_x;
+            if(glyph) pos_y += glyph->advance_y * scale_y;
+        }
     }
 
     // Calculate offset for anchor
@@ -274,43 +788,100 @@ void graphics_label_set_text(drawable_t *d, const char *text)
                 break;
 
             case ANCHOR_CENTER_TOP:
-                offset_x = (array[num - 4] - array[0]) / 2.0;
+                offset_x = (ink_right - ink_left) / 2.0;
                 offset_y = row_bottom - row_top;
                 break;
 
             case ANCHOR_RIGHT_TOP:
-                offset_x = (array[num - 4] - array[0]);
+                offset_x = (ink_right - ink_left);
                 offset_y = row_bottom - row_top;
                 break;
 
             case ANCHOR_RIGHT_BOTTOM:
-                offset_x = (array[num - 4] - array[0]);
+                offset_x = (ink_right - ink_left);
                 break;
 
             case ANCHOR_CENTER_BOTTOM:
-                offset_x = (array[num - 4] - array[0]) / 2.0;
+                offset_x = (ink_right - ink_left) / 2.0;
                 break;
 
             case ANCHOR_CENTER:
-                offset_x = (array[num - 4] - array[0]) / 2.0;
+                offset_x = (ink_right - ink_left) / 2.0;
                 offset_y = (row_bottom - row_top) / 2.0;
         }
 
         // Apply offset
-        int i;
+        offset_x -= fmodf(offset_x, pixel_x);
+        offset_y -= fmodf(offset_y, pixel_y);
         for(i = 0; i < num / 4; i++)
         {
-            array[i * 4 + 0] -= offset_x - fmodf(offset_x, scale_x);
-            array[i * 4 + 1] -= offset_y - fmodf(offset_y, scale_y);
+            array[i * 4 + 0] -= offset_x;
+            array[i * 4 + 1] -= offset_y;
+        }
+
+        // Readout cells move along
+        if(readout)
+        {
+            readout->pos_y -= offset_y;
+            for(i = 0; readout->number[i]; i++) readout->cell_x[i] -= offset_x;
         }
     }
 
-    // Buffer array
-    glBindBuffer(GL_ARRAY_BUFFER, label->d.vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(array), array, GL_DYNAMIC_DRAW);
     label->d.num = num / 4;
 }
 
+void graphics_label_set_text(drawable_t *d, const char *text)
+{
+    DEBUG("graphics_label_set_text()");
+    assert(d != 0);
+    assert(text != 0);
+    assert(d->type == DRAWABLE_LABEL);
+    struct _drawable_label *label = (struct _drawable_label*)d;
+
+    // Skip layout of unchanged text
+    if(label->text && (label->generation == label->atlas->generation) && (strcmp(label->text, text) == 0)) return;
+
+    free(label->text);
+    label->text = strdup(text);
+    assert(label->text != 0);
+    label_layout(label);
+}
+
+void graphics_label_set_size(drawable_t *d, uint32_t size)
+{
+    DEBUG("graphics_label_set_size()");
+    assert(d != 0);
+    assert(d->type == DRAWABLE_LABEL);
+    struct _drawable_label *label = (struct _drawable_label*)d;
+
+    if(label->size == size) return;
+    label->size = size;
+    if(label->text) label_layout(label);
+}
+
+void label_revalidate(struct _drawable *d)
+{
+    struct _drawable_label *label = (struct _drawable_label*)d;
+    if(label->text && (label->generation != label->atlas->generation)) label_layout(label);
+}
+
+const GLuint *label_texture_height(struct _drawable *d)
+{
+    struct _drawable_label *label = (struct _drawable_label*)d;
+    return &label->atlas->height;
+}
+
+void label_release(struct _drawable *d)
+{
+    struct _drawable_label *label = (struct _drawable_label*)d;
+    if(label->readout)
+    {
+        free(label->readout->suffix);
+        free(label->readout);
+    }
+    free(label->text);
+}
+
 void graphics_label_set_color(drawable_t *d, const uint8_t color[4])
 {
     DEBUG("graphics_label_set_color()");
@@ -324,11 +895,98 @@ void graphics_label_set_color(drawable_t *d, const uint8_t color[4])
     d->mask[3] = color[3] / 255.0;
 }
 
+drawable_t *graphics_readout_create(graphics_t *g, atlas_t *atlas, enum anchor_types anchor, uint32_t decimals, const char *suffix)
+{
+    DEBUG("graphics_readout_create()");
+    assert(suffix != 0);
+    assert(decimals <= READOUT_DECIMALS_MAX);
+
+    struct _drawable_label *label = (struct _drawable_label*)graphics_label_create(g, atlas, anchor);
+    struct readout *readout = calloc(1, sizeof(struct readout));
+    assert(readout != 0);
+
+    readout->suffix = strdup(suffix);
+    readout->decimals = decimals;
+    assert(readout->suffix != 0);
+    label->readout = readout;
+    label->text = strdup("");
+    assert(label->text != 0);
+
+    graphics_readout_set_value((drawable_t*)label, 0);
+    return (drawable_t*)label;
+}
+
+/* Formats value rounded to the decimal places */
+static void readout_format(char *str, float value, uint32_t decimals)
+{
+    static const float powers[READOUT_DECIMALS_MAX + 1] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+    char digits[READOUT_LENGTH];
+    int len = 0;
+
+    // Round to nearest even as printf does, saturate including NaN
+    float scaled = nearbyintf(fabsf(value) * powers[decimals]);
+    uint32_t n = (scaled < READOUT_VALUE_MAX) ? (uint32_t)scaled : READOUT_VALUE_MAX;
+    if((value < 0) && n) *str++ = '-';
+
+    // Digits are extracted from the least significant one
+    do
+    {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    }
+    while(n || (len <= decimals));
+
+    while(len--)
+    {
+        *str++ = digits[len];
+        if(decimals && (len == decimals)) *str++ = '.';
+    }
+    *str = 0;
+}
+
+void graphics_readout_set_value(drawable_t *d, float value)
+{
+    DEBUG("graphics_readout_set_value()");
+    assert(d != 0);
+    assert(d->type == DRAWABLE_LABEL);
+    struct _drawable_label *label = (struct _drawable_label*)d;
+    struct readout *readout = label->readout;
+    assert(readout != 0);
+
+    char number[READOUT_LENGTH];
+    readout_format(number, value, readout->decimals);
+
+    // Characters move if the length or sign changes, texture coordinates if the atlas was resized
+    if((strlen(number) != strlen(readout->number)) || ((number[0] == '-') != (readout->number[0] == '-')) ||
+       (label->generation != label->atlas->generation))
+    {
+        strcpy(readout->number, number);
+        label_layout(label);
+        return;
+    }
+
+    // Only the changed digits are replaced
+    int i;
+    for(i = 0; number[i]; i++)
+    {
+        if(number[i] == readout->number[i]) continue;
+        readout->number[i] = number[i];
+        readout_quad(label, i);
+    }
+}
+
 void graphics_atlas_free(atlas_t *atlas)
 {
     DEBUG("graphics_atlas_free()");
     assert(atlas != 0);
 
+    INFO("Atlas cached %u %s glyphs in %ux%u texture", atlas->glyph_num, atlas->sdf ? "distance field" : "coverage", atlas->width, atlas->height);
+    if(atlas->cache[0] && atlas->dirty) atlas_cache_store(atlas);
     glDeleteTextures(1, &atlas->texture);
+    if(atlas->ft) FT_Done_FreeType(atlas->ft);
+    free(atlas->font);
+    free(atlas->bitmap);
+    free(atlas->glyphs);
+    free(atlas->shelves);
     free(atlas);
 }
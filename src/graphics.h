@@ -22,8 +22,9 @@
  * @code
  * int main ()
  * {
- *     graphics_t *g = graphics_init(0);
- *     atlas_t *atlas = graphics_atlas_create("FreeSans.ttf", 20);
+ *     struct graphics_config config = { .offscreen = false };
+ *     graphics_t *g = graphics_init(0, &config);
+ *     atlas_t *atlas = graphics_atlas_create("FreeSans.ttf", 20, false, NULL);
  *
  *     drawable_t *label = graphics_label_create(g, atlas);
  *     graphics_label_set_text(label, 0, "Hello World");
@@ -47,6 +48,9 @@
 #define GRAPHICS_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "graphics-config.h"
 
 /**
  * @brief Internal graphics state
@@ -68,6 +72,119 @@ typedef struct _atlas atlas_t;
  */
 typedef struct _hud hud_t;
 
+/**
+ * @brief Graphics statistics
+ */
+struct graphics_stats
+{
+    /**
+     * @brief Image frames uploaded by CPU copy
+     */
+    uint32_t frames_uploaded;
+
+    /**
+     * @brief Image frames imported from DMABUF without copy
+     */
+    uint32_t frames_imported;
+
+    /**
+     * @brief Image bytes uploaded by CPU copy
+     */
+    uint64_t bytes_uploaded;
+
+    /**
+     * @brief Frames flushed by `graphics_flush()`
+     */
+    uint32_t frames;
+
+    /**
+     * @brief Drawables submitted by `graphics_draw()`
+     */
+    uint32_t draws;
+
+    /**
+     * @brief Draw calls issued to OpenGL in total
+     */
+    uint32_t draw_calls;
+
+    /**
+     * @brief Draw calls issued to OpenGL in the last flushed frame
+     */
+    uint32_t frame_draw_calls;
+
+    /**
+     * @brief Label text layouts performed in total
+     */
+    uint32_t label_layouts;
+
+    /**
+     * @brief Label text layouts performed in the last flushed frame
+     */
+    uint32_t frame_label_layouts;
+
+    /**
+     * @brief Vertex bytes uploaded by the draw list in total
+     */
+    uint64_t vertex_bytes;
+
+    /**
+     * @brief Vertex bytes uploaded by the draw list in the last flushed frame
+     */
+    uint32_t frame_vertex_bytes;
+
+    /**
+     * @brief State changing OpenGL calls issued
+     */
+    uint32_t state_issued;
+
+    /**
+     * @brief State changing OpenGL calls skipped as redundant
+     */
+    uint32_t state_elided;
+
+    /**
+     * @brief Frames read back to file
+     */
+    uint32_t frames_read;
+};
+
+/**
+ * @brief HUD statistics
+ */
+struct hud_stats
+{
+    /**
+     * @brief Frames the HUD layer was rendered in
+     */
+    uint32_t renders;
+
+    /**
+     * @brief Frames the previously rendered HUD layer was reused in
+     */
+    uint32_t hits;
+};
+
+/**
+ * @brief Frame timing percentiles of recent frames in milliseconds
+ */
+struct graphics_timing
+{
+    /**
+     * @brief Number of frames the percentiles are computed from
+     */
+    uint32_t frames;
+
+    /**
+     * @brief Time blocked in buffer swap, 50th, 95th and 99th percentile
+     */
+    float swap_p50, swap_p95, swap_p99;
+
+    /**
+     * @brief Interval between consecutive presents, 50th, 95th and 99th percentile
+     */
+    float present_p50, present_p95, present_p99;
+};
+
 /**
  * @brief Anchor options
  */
@@ -84,25 +201,40 @@ enum anchor_types
 
 /**
  * @brief Initializes graphics
- * @param window native window id
+ * @param window native window id, ignored for offscreen rendering
+ * @param config Pointer to graphics configuration structure
  * @return Internal graphics object
  */
-graphics_t *graphics_init(uint32_t window);
+graphics_t *graphics_init(uint32_t window, const struct graphics_config *config);
+
+/**
+ * @brief Reads back pixels of the rendered frame
+ * @param g Internal graphics object as returned by `graphics_init()`
+ * @param[out] buffer RGBA buffer of surface size, rows are stored top to bottom
+ * @note Call after drawing and before `graphics_flush()`, pending draw list is drawn first.
+ */
+void graphics_read_pixels(graphics_t *g, uint8_t *buffer);
 
 /**
  * @brief Creates font atlas
  * @param font TTF font file to use
- * @param size Font size
+ * @param size Font size of labels using this atlas
+ * @param sdf Store glyphs as signed distance field, rasterized once at a reference size and drawn sharp at any size
+ * @param cache Directory of atlas cache keyed by font file contents and size, NULL to disable
  * @return Atlas object
+ * @note Glyphs are rasterized on first use, atlas texture grows as needed.
+ * Distance field atlases require FreeType 2.11 or newer.
+ * With a valid cache the font is opened only when a glyph is missing, glyphs added are stored to cache at release.
  */
-atlas_t *graphics_atlas_create(const char *font, uint32_t size);
+atlas_t *graphics_atlas_create(const char *font, uint32_t size, bool sdf, const char *cache);
 
 /**
- * @brief Swaps framebuffers
+ * @brief Draws the collected draw list and swaps framebuffers
  * @param g Internal graphics object as returned by `graphics_init()`
  * @param color If not NULL, this is a RBG color used to clear the screen
  * @return 1 on success, 0 on failure
  * @note Passing NULL as color will skip clearing the framebuffer.
+ * With `frame_rate` configured, swap is delayed until the next tick of the pacing timer.
  */
 int graphics_flush(graphics_t *g, const uint8_t *color);
 
@@ -114,6 +246,8 @@ int graphics_flush(graphics_t *g, const uint8_t *color);
  * @param y Vertical coordinate
  * @param scale Relative scale (0-1)
  * @param rotation Rotation angle in radians
+ * @note Labels and HUD elements are only collected to a draw list, which is sorted by texture and drawing mode
+ * and drawn by a few large draw calls at `graphics_flush()`. Images are drawn immediately, after the pending list.
  */
 void graphics_draw(graphics_t *g, drawable_t *d, int x, int y, float scale, float rotation);
 
@@ -127,12 +261,26 @@ void graphics_draw(graphics_t *g, drawable_t *d, int x, int y, float scale, floa
  */
 drawable_t *graphics_label_create(graphics_t *g, atlas_t *atlas, enum anchor_types anchor);
 
+/**
+ * @brief Creates numeric readout label
+ * @param g Internal graphics object as returned by `graphics_init()`
+ * @param atlas Atlas object as returned by `graphics_atlas_create()`
+ * @param anchor Anchor used for drawing
+ * @param decimals Number of decimal places (0-6)
+ * @param suffix Unit suffix eg. " km/h"
+ * @return Drawable object
+ * @note Readout is a label showing its text followed by the value and suffix, digits are laid out with fixed width
+ * and setting the value only replaces quads of the changed digits. Label functions may be used with readouts.
+ */
+drawable_t *graphics_readout_create(graphics_t *g, atlas_t *atlas, enum anchor_types anchor, uint32_t decimals, const char *suffix);
+
 /**
  * @brief Creates drawable image
  * @param g Internal graphics object as returned by `graphics_init()`
  * @param width Texture width in pixels
  * @param height Texture height in pixels
- * @param format Image source format in fourcc
+ * @param format Image source format in fourcc ("RGB4", "MJPG", "YUYV", "NV12" or "YU12"), JPEG frames are scaled down to this size if needed,
+ *        they are decoded to RGBx or to Y, U and V planes if `decode_yuv` is configured
  * @param anchor Anchor used for drawing
  * @return Drawable object
  */
@@ -163,6 +311,13 @@ hud_t *graphics_hud_create(graphics_t *g, atlas_t *atlas, uint8_t color[4], uint
  */
 void graphics_hud_draw(hud_t *hud, float attitude[3], float speed, float altitude, float track, float bearing, float distance, const char *waypoint);
 
+/**
+ * @brief Gets HUD layer statistics
+ * @param hud HUD object
+ * @param[out] stats Statistics structure
+ */
+void graphics_hud_get_stats(hud_t *hud, struct hud_stats *stats);
+
 /**
  * @brief Releases resources from HUD object
  * @param hud HUD object
@@ -172,10 +327,18 @@ void graphics_hud_free(hud_t *hud);
 /**
  * @brief Updates label text
  * @param label Label object to update
- * @param text NULL terminated string
+ * @param text NULL terminated UTF-8 string
  */
 void graphics_label_set_text(drawable_t *label, const char *text);
 
+/**
+ * @brief Updates label font size
+ * @param label Label object to update
+ * @param size Font size in pixels, zero for the size of atlas
+ * @note Labels of coverage atlases get blurred if scaled, use distance field atlas for sizes differing from the atlas.
+ */
+void graphics_label_set_size(drawable_t *label, uint32_t size);
+
 /**
  * @brief Updates label color
  * @param label Label object to update
@@ -183,14 +346,41 @@ void graphics_label_set_text(drawable_t *label, const char *text);
  */
 void graphics_label_set_color(drawable_t *label, const uint8_t color[4]);
 
+/**
+ * @brief Updates readout value
+ * @param readout Readout object to update
+ * @param value Value, rounded to the decimal places and saturated to nine digits
+ */
+void graphics_readout_set_value(drawable_t *readout, float value);
+
+/**
+ * @brief Limits image to centered rows of the source frame, only these rows are uploaded
+ * @param image Image object to update
+ * @param rows Number of visible rows, 0 for the whole frame
+ * @note Image is drawn with the height of visible rows, texture storage is reallocated
+ */
+void graphics_image_set_crop(drawable_t *image, uint32_t rows);
+
 /**
  * @brief Updates image bitmap
  * @param image Image object to update
- * @param buffer Pixel data buffer in RGBx format (width * height * 32)
+ * @param buffer Pixel data buffer in image source format, RGBx (width * height * 32) for "RGB4",
+ *        packed YUYV (width * height * 16) for "YUYV", Y plane followed by interleaved UV plane (width * height * 12) for "NV12",
+ *        full range Y, U and V planes for "YU12" where the chroma subsampling (4:2:0, 4:2:2 or 4:4:4) is given by the length
  * @param len Buffer length in bytes
  */
 void graphics_image_set_bitmap(drawable_t *image, void *buffer, uint32_t len);
 
+/**
+ * @brief Updates image bitmap by importing DMABUF
+ * @param image Image object to update
+ * @param fd DMABUF file descriptor holding pixel data in RGBx format
+ * @param stride Line length in bytes
+ * @return 1 on success, 0 if import is not supported or failed for this image
+ * @note Imported buffers are cached by file descriptor, use `graphics_image_set_bitmap()` as fallback.
+ */
+int graphics_image_set_dmabuf(drawable_t *image, int fd, uint32_t stride);
+
 /**
  * @brief Releases resources of the specified object
  * @param d Drawable object to free
@@ -203,6 +393,21 @@ void graphics_drawable_free(drawable_t *d);
  */
 void graphics_atlas_free(atlas_t *atlas);
 
+/**
+ * @brief Gets graphics statistics
+ * @param g Internal graphics object as returned by `graphics_init()`
+ * @param[out] stats Statistics structure
+ */
+void graphics_get_stats(graphics_t *g, struct graphics_stats *stats);
+
+/**
+ * @brief Gets frame timing percentiles
+ * @param g Internal graphics object as returned by `graphics_init()`
+ * @param[out] timing Timing structure
+ * @note Percentiles are computed from the last 512 frames
+ */
+void graphics_get_timing(graphics_t *g, struct graphics_timing *timing);
+
 /**
  * @brief Releases graphics resources
  * @param g Internal graphics object as returned by `graphics_init()`
@@ -22,6 +22,8 @@
 #ifndef IMU_CONFIG_H
 #define IMU_CONFIG_H
 
+#include <stdbool.h>
+
 /**
  * @brief IMU configuration structure
  */
@@ -46,6 +48,11 @@ struct imu_config
      * @brief Accelerometer measurement scale
      */
     float acc_scale;
+
+    /**
+     * @brief Do not start the worker thread, `imu_process()` is called by the user when the descriptor is readable
+     */
+    bool polled;
 };
 
 #endif /* IMU_CONFIG_H */
@@ -21,6 +21,8 @@
 #include <fcntl.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "debug.h"
@@ -40,6 +42,9 @@ struct _imu
     uint64_t reftime;
     float accsum[3];
 
+    bool initialized;
+    uint32_t reads;
+
     pthread_t thread;
     pthread_mutex_t mutex;
     const struct imu_config *config;
@@ -83,76 +88,96 @@ inline void vect_norm(float a[3], float res[3])
     res[2] = a[2] / len;
 }
 
-static void *worker(void *arg)
+/* Processes single IIO buffer */
+static void update(imu_t *imu, struct buffer buf)
 {
-    INFO("Thread started");
     float gyro[3], mag[3], acc[3];
-    struct buffer buf;
-    imu_t *imu = (imu_t*)arg;
 
-    // Read first buffer
-    if(read(imu->fd, &buf, sizeof(struct buffer)) != sizeof(struct buffer)) goto finalize;
+    if(!imu->initialized)
+    {
+        // Initialize DCM
+        pthread_mutex_lock(&imu->mutex);
+        dequantize(imu->config, buf, gyro, mag, acc);
+        INFO("Gyro [%f, %f, %f], Mag [%f, %f, %f], Acc [%f, %f, %f]",
+             gyro[0], gyro[1], gyro[2], mag[0], mag[1], mag[2], acc[0], acc[1], acc[2]);
+
+        vect_norm(mag, mag);
+        vect_norm(acc, &imu->dcm[6]);
+        vect_mult(&imu->dcm[6], mag, &imu->dcm[3]);
+        vect_mult(&imu->dcm[3], &imu->dcm[6], &imu->dcm[0]);
+        imu->reftime = imu->timestamp = buf.timestamp;
+        imu->initialized = true;
+        pthread_mutex_unlock(&imu->mutex);
+        return;
+    }
 
-    // Initialize DCM
     pthread_mutex_lock(&imu->mutex);
     dequantize(imu->config, buf, gyro, mag, acc);
     INFO("Gyro [%f, %f, %f], Mag [%f, %f, %f], Acc [%f, %f, %f]",
          gyro[0], gyro[1], gyro[2], mag[0], mag[1], mag[2], acc[0], acc[1], acc[2]);
 
+    // Rotate to global frame
+    imu->accsum[0] += imu->dcm[0] * acc[0] + imu->dcm[1] * acc[1] + imu->dcm[2] * acc[2];
+    imu->accsum[1] += imu->dcm[3] * acc[0] + imu->dcm[4] * acc[1] + imu->dcm[5] * acc[2];
+    imu->accsum[2] += imu->dcm[6] * acc[0] + imu->dcm[7] * acc[1] + imu->dcm[8] * acc[2] - EARTH_GRAVITY;
+
+    // Integrate
+    float diff = (float)(buf.timestamp - imu->timestamp) / 1e9;
+    gyro[0] *= diff;
+    gyro[1] *= diff;
+    gyro[2] *= diff;
+    imu->timestamp = buf.timestamp;
+    imu->dcm[0] = imu->dcm[0] + imu->dcm[3] * (gyro[0] * gyro[1] + gyro[2]) + imu->dcm[6] * (gyro[0] * gyro[2] - gyro[1]);
+    imu->dcm[1] = imu->dcm[1] + imu->dcm[4] * (gyro[0] * gyro[1] + gyro[2]) + imu->dcm[7] * (gyro[0] * gyro[2] - gyro[1]);
+    imu->dcm[2] = imu->dcm[2] + imu->dcm[5] * (gyro[0] * gyro[1] + gyro[2]) + imu->dcm[8] * (gyro[0] * gyro[2] - gyro[1]);
+    imu->dcm[3] = imu->dcm[0] * -gyro[2] + imu->dcm[3] * (1 - gyro[0] * gyro[1] * gyro[2]) + imu->dcm[6] * (gyro[0] + gyro[1] * gyro[2]);
+    imu->dcm[4] = imu->dcm[1] * -gyro[2] + imu->dcm[4] * (1 - gyro[0] * gyro[1] * gyro[2]) + imu->dcm[7] * (gyro[0] + gyro[1] * gyro[2]);
+    imu->dcm[5] = imu->dcm[2] * -gyro[2] + imu->dcm[5] * (1 - gyro[0] * gyro[1] * gyro[2]) + imu->dcm[8] * (gyro[0] + gyro[1] * gyro[2]);
+    imu->dcm[6] = imu->dcm[0] * gyro[1] + imu->dcm[3] * -gyro[0] + imu->dcm[6];
+    imu->dcm[7] = imu->dcm[1] * gyro[1] + imu->dcm[4] * -gyro[0] + imu->dcm[7];
+    imu->dcm[8] = imu->dcm[2] * gyro[1] + imu->dcm[5] * -gyro[0] + imu->dcm[8];
+
+    // Compute average
+    float tmp[3];
     vect_norm(mag, mag);
-    vect_norm(acc, &imu->dcm[6]);
-    vect_mult(&imu->dcm[6], mag, &imu->dcm[3]);
-    vect_mult(&imu->dcm[3], &imu->dcm[6], &imu->dcm[0]);
-    imu->reftime = imu->timestamp = buf.timestamp;
+    vect_norm(acc, acc);
+    vect_mult(acc, mag, tmp);
+    vect_mult(tmp, acc, mag);
+    imu->dcm[0] = imu->config->gyro_weight * imu->dcm[0] + (1 - imu->config->gyro_weight) * mag[0];
+    imu->dcm[1] = imu->config->gyro_weight * imu->dcm[1] + (1 - imu->config->gyro_weight) * mag[1];
+    imu->dcm[2] = imu->config->gyro_weight * imu->dcm[2] + (1 - imu->config->gyro_weight) * mag[2];
+    imu->dcm[3] = imu->config->gyro_weight * imu->dcm[3] + (1 - imu->config->gyro_weight) * tmp[0];
+    imu->dcm[4] = imu->config->gyro_weight * imu->dcm[4] + (1 - imu->config->gyro_weight) * tmp[1];
+    imu->dcm[5] = imu->config->gyro_weight * imu->dcm[5] + (1 - imu->config->gyro_weight) * tmp[2];
+    imu->dcm[6] = imu->config->gyro_weight * imu->dcm[6] + (1 - imu->config->gyro_weight) * acc[0];
+    imu->dcm[7] = imu->config->gyro_weight * imu->dcm[7] + (1 - imu->config->gyro_weight) * acc[1];
+    imu->dcm[8] = imu->config->gyro_weight * imu->dcm[8] + (1 - imu->config->gyro_weight) * acc[2];
     pthread_mutex_unlock(&imu->mutex);
+}
 
-    while(read(imu->fd, &buf, sizeof(struct buffer)) == sizeof(struct buffer))
-    {
-        pthread_mutex_lock(&imu->mutex);
-        dequantize(imu->config, buf, gyro, mag, acc);
-        INFO("Gyro [%f, %f, %f], Mag [%f, %f, %f], Acc [%f, %f, %f]",
-             gyro[0], gyro[1], gyro[2], mag[0], mag[1], mag[2], acc[0], acc[1], acc[2]);
+int imu_process(imu_t *imu)
+{
+    DEBUG("imu_process()");
+    assert(imu != 0);
 
-        // Rotate to global frame
-        imu->accsum[0] += imu->dcm[0] * acc[0] + imu->dcm[1] * acc[1] + imu->dcm[2] * acc[2];
-        imu->accsum[1] += imu->dcm[3] * acc[0] + imu->dcm[4] * acc[1] + imu->dcm[5] * acc[2];
-        imu->accsum[2] += imu->dcm[6] * acc[0] + imu->dcm[7] * acc[1] + imu->dcm[8] * acc[2] - EARTH_GRAVITY;
-
-        // Integrate
-        float diff = (float)(buf.timestamp - imu->timestamp) / 1e9;
-        gyro[0] *= diff;
-        gyro[1] *= diff;
-        gyro[2] *= diff;
-        imu->timestamp = buf.timestamp;
-        imu->dcm[0] = imu->dcm[0] + imu->dcm[3] * (gyro[0] * gyro[1] + gyro[2]) + imu->dcm[6] * (gyro[0] * gyro[2] - gyro[1]);
-        imu->dcm[1] = imu->dcm[1] + imu->dcm[4] * (gyro[0] * gyro[1] + gyro[2]) + imu->dcm[7] * (gyro[0] * gyro[2] - gyro[1]);
-        imu->dcm[2] = imu->dcm[2] + imu->dcm[5] * (gyro[0] * gyro[1] + gyro[2]) + imu->dcm[8] * (gyro[0] * gyro[2] - gyro[1]);
-        imu->dcm[3] = imu->dcm[0] * -gyro[2] + imu->dcm[3] * (1 - gyro[0] * gyro[1] * gyro[2]) + imu->dcm[6] * (gyro[0] + gyro[1] * gyro[2]);
-        imu->dcm[4] = imu->dcm[1] * -gyro[2] + imu->dcm[4] * (1 - gyro[0] * gyro[1] * gyro[2]) + imu->dcm[7] * (gyro[0] + gyro[1] * gyro[2]);
-        imu->dcm[5] = imu->dcm[2] * -gyro[2] + imu->dcm[5] * (1 - gyro[0] * gyro[1] * gyro[2]) + imu->dcm[8] * (gyro[0] + gyro[1] * gyro[2]);
-        imu->dcm[6] = imu->dcm[0] * gyro[1] + imu->dcm[3] * -gyro[0] + imu->dcm[6];
-        imu->dcm[7] = imu->dcm[1] * gyro[1] + imu->dcm[4] * -gyro[0] + imu->dcm[7];
-        imu->dcm[8] = imu->dcm[2] * gyro[1] + imu->dcm[5] * -gyro[0] + imu->dcm[8];
-
-        // Compute average
-        float tmp[3];
-        vect_norm(mag, mag);
-        vect_norm(acc, acc);
-        vect_mult(acc, mag, tmp);
-        vect_mult(tmp, acc, mag);
-        imu->dcm[0] = imu->config->gyro_weight * imu->dcm[0] + (1 - imu->config->gyro_weight) * mag[0];
-        imu->dcm[1] = imu->config->gyro_weight * imu->dcm[1] + (1 - imu->config->gyro_weight) * mag[1];
-        imu->dcm[2] = imu->config->gyro_weight * imu->dcm[2] + (1 - imu->config->gyro_weight) * mag[2];
-        imu->dcm[3] = imu->config->gyro_weight * imu->dcm[3] + (1 - imu->config->gyro_weight) * tmp[0];
-        imu->dcm[4] = imu->config->gyro_weight * imu->dcm[4] + (1 - imu->config->gyro_weight) * tmp[1];
-        imu->dcm[5] = imu->config->gyro_weight * imu->dcm[5] + (1 - imu->config->gyro_weight) * tmp[2];
-        imu->dcm[6] = imu->config->gyro_weight * imu->dcm[6] + (1 - imu->config->gyro_weight) * acc[0];
-        imu->dcm[7] = imu->config->gyro_weight * imu->dcm[7] + (1 - imu->config->gyro_weight) * acc[1];
-        imu->dcm[8] = imu->config->gyro_weight * imu->dcm[8] + (1 - imu->config->gyro_weight) * acc[2];
-        pthread_mutex_unlock(&imu->mutex);
+    struct buffer buf;
+    ssize_t len;
+    while((len = read(imu->fd, &buf, sizeof(struct buffer))) == sizeof(struct buffer))
+    {
+        imu->reads++;
+        update(imu, buf);
     }
 
-finalize:
+    return (len == -1) && (errno == EAGAIN);
+}
+
+static void *worker(void *arg)
+{
+    INFO("Thread started");
+    imu_t *imu = (imu_t*)arg;
+
+    while(imu_process(imu));
+
     ERROR("Broken pipe");
     return NULL;
 }
@@ -180,9 +205,11 @@ imu_t *imu_init(const char *device, const struct imu_config *config)
     imu->accsum[1] = 0;
     imu->accsum[2] = 0;
     imu->reftime = 0;
+    imu->initialized = false;
+    imu->reads = 0;
 
     // Open device
-    if((imu->fd = open(device, O_RDONLY | O_NOCTTY)) == -1)
+    if((imu->fd = open(device, O_RDONLY | O_NOCTTY | (config->polled ? O_NONBLOCK : 0))) == -1)
     {
         WARN("Failed to open `%s`", device);
         free(imu);
@@ -190,7 +217,7 @@ imu_t *imu_init(const char *device, const struct imu_config *config)
     }
 
     // Start worker thread
-    if(pthread_mutex_init(&imu->mutex, NULL) || pthread_create(&imu->thread, NULL, worker, imu))
+    if(pthread_mutex_init(&imu->mutex, NULL) || (!config->polled && pthread_create(&imu->thread, NULL, worker, imu)))
     {
         WARN("Failed to create thread");
         close(imu->fd);
@@ -201,6 +228,14 @@ imu_t *imu_init(const char *device, const struct imu_config *config)
     return imu;
 }
 
+int imu_get_fd(imu_t *imu)
+{
+    DEBUG("imu_get_fd()");
+    assert(imu != 0);
+
+    return imu->fd;
+}
+
 void imu_get_attitude(imu_t *imu, float attitude[3])
 {
     DEBUG("imu_get_attitude()");
@@ -238,8 +273,12 @@ void imu_free(imu_t *imu)
     DEBUG("imu_free()");
     assert(imu != 0);
 
-    pthread_cancel(imu->thread);
-    pthread_join(imu->thread, NULL);
+    if(!imu->config->polled)
+    {
+        pthread_cancel(imu->thread);
+        pthread_join(imu->thread, NULL);
+    }
+    INFO("Processed %u reads", imu->reads);
     pthread_mutex_destroy(&imu->mutex);
     close(imu->fd);
     free(imu);
@@ -18,6 +18,8 @@
  * @section DESCRIPTION
  * This is an inertial measurement unit providing attitude data.
  * Measurements are done on separate thread.
+ * If `polled` is set in the configuration, no thread is started and `imu_process()` should be called
+ * whenever the descriptor returned by `imu_get_fd()` becomes readable.
  * @note All functions do not block
  *
  * Example:
@@ -66,6 +68,21 @@ typedef struct _imu imu_t;
  */
 imu_t *imu_init(const char *device, const struct imu_config *config);
 
+/**
+ * @brief Gets device file descriptor
+ * @param imu Object as returned by `imu_init()`
+ * @return File descriptor, opened as non-blocking in polled mode
+ */
+int imu_get_fd(imu_t *imu);
+
+/**
+ * @brief Reads and processes all pending measurements
+ * @param imu Object as returned by `imu_init()`
+ * @return 1 if no more data is pending, 0 on end of stream or error
+ * @note Used in polled mode only, the worker thread calls this in a loop otherwise
+ */
+int imu_process(imu_t *imu);
+
 /**
  * @brief Gets attitude information
  * @param imu Object as returned by `imu_init()`
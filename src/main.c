@@ -19,6 +19,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
+#include <signal.h>
+#include <stdbool.h>
 
 #include "debug.h"
 #include "application.h"
@@ -46,6 +48,32 @@ static unsigned long window_create(uint32_t width, uint32_t height)
 #define window_create(width, height)  0
 #endif
 
+/* Parses `true` or `false` string and releases it */
+static void parse_bool(char *str, bool *value)
+{
+    if(!strcmp(str, "true"))
+    {
+        *value = true;
+    }
+    else if(!strcmp(str, "false"))
+    {
+        *value = false;
+    }
+    else
+    {
+        WARN("Parse error");
+    }
+    free(str);
+}
+
+/* Application instance for signal handler */
+static application_t *app = NULL;
+
+static void signal_handler(int signum)
+{
+    if(app) application_stop(app);
+}
+
 int main(int argc, char *argv[])
 {
     DEBUG("main()");
@@ -54,6 +82,8 @@ int main(int argc, char *argv[])
     static struct config cfg =
     {
         .app_landmark_vis_dist = 5000,
+        .app_event_loop = false,
+        .app_render_rate = 30,
 
         .video_device = "/dev/video0",
         .video_width = 800,
@@ -64,12 +94,33 @@ int main(int argc, char *argv[])
         .video_interlace = 0,
         .video_hfov = 1.0471, // 60 deg
         .video_vfov = 1.0471,
+        .video_conf =
+        {
+            .buffer_count = 4,
+            .latest = false,
+            .replay = VIDEO_REPLAY_RECORDED,
+            .replay_fps = 30,
+            .replay_loop = false,
+            .decoder_count = 1,
+            .decode_yuv = false,
+        },
 
         .graphics_font_file = "/usr/share/fonts/truetype/freefont/FreeSans.ttf",
         .graphics_font_color_1 = { 0, 0, 0, 255 },
         .graphics_font_color_2 = { 0, 0, 0, 255 },
         .graphics_font_size_1 = 20,
         .graphics_font_size_2 = 12,
+        .graphics_font_sdf = false,
+        .graphics_atlas_cache = NULL,
+        .graphics_conf =
+        {
+            .offscreen = false,
+            .swap_interval = 1,
+            .frame_rate = 0,
+            .shader_cache = NULL,
+            .readback_file = NULL,
+            .readback_interval = 1,
+        },
 
         .imu_device = "/dev/null",
         .imu_conf =
@@ -107,10 +158,13 @@ int main(int argc, char *argv[])
                 INFO("Parsing config line `%s`", str);
 
                 // Parse line
-                char *interlace = NULL;
+                char *event_loop = NULL, *interlace = NULL, *dmabuf = NULL, *latest = NULL, *replay = NULL, *replay_loop = NULL, *decode_yuv = NULL, *offscreen = NULL, *font_sdf = NULL;
                 int baudrate = 0;
                 if(sscanf(str, "app_landmarks_file = %ms", &cfg.gps_conf.datafile) != 1)
                 if(sscanf(str, "app_landmark_vis_dist = %f", &cfg.app_landmark_vis_dist) != 1)
+                if(sscanf(str, "app_event_loop = %ms", &event_loop) != 1)
+                if(sscanf(str, "app_render_rate = %f", &cfg.app_render_rate) != 1)
+                if(sscanf(str, "app_frame_limit = %u", &cfg.app_frame_limit) != 1)
                 if(sscanf(str, "window_width = %u", &cfg.window_width) != 1)
                 if(sscanf(str, "window_height = %u", &cfg.window_height) != 1)
                 if(sscanf(str, "video_device = %ms", &cfg.video_device) != 1)
@@ -120,11 +174,27 @@ int main(int argc, char *argv[])
                 if(sscanf(str, "video_interlace = %ms", &interlace) != 1)
                 if(sscanf(str, "video_hfov = %f", &cfg.video_hfov) != 1)
                 if(sscanf(str, "video_vfov = %f", &cfg.video_vfov) != 1)
+                if(sscanf(str, "video_dmabuf = %ms", &dmabuf) != 1)
+                if(sscanf(str, "video_buffers = %u", &cfg.video_conf.buffer_count) != 1)
+                if(sscanf(str, "video_latest = %ms", &latest) != 1)
+                if(sscanf(str, "video_replay = %ms", &replay) != 1)
+                if(sscanf(str, "video_replay_fps = %f", &cfg.video_conf.replay_fps) != 1)
+                if(sscanf(str, "video_replay_loop = %ms", &replay_loop) != 1)
+                if(sscanf(str, "video_decoders = %u", &cfg.video_conf.decoder_count) != 1)
+                if(sscanf(str, "video_decode_yuv = %ms", &decode_yuv) != 1)
                 if(sscanf(str, "graphics_font_file = %ms", &cfg.graphics_font_file) != 1)
                 if(sscanf(str, "graphics_font_color_1 = %x", (uint32_t*)cfg.graphics_font_color_1) != 1)
                 if(sscanf(str, "graphics_font_color_2 = %x", (uint32_t*)cfg.graphics_font_color_2) != 1)
                 if(sscanf(str, "graphics_font_size_1 = %hhu", &cfg.graphics_font_size_1) != 1)
                 if(sscanf(str, "graphics_font_size_2 = %hhu", &cfg.graphics_font_size_2) != 1)
+                if(sscanf(str, "graphics_font_sdf = %ms", &font_sdf) != 1)
+                if(sscanf(str, "graphics_atlas_cache = %ms", &cfg.graphics_atlas_cache) != 1)
+                if(sscanf(str, "graphics_swap_interval = %u", &cfg.graphics_conf.swap_interval) != 1)
+                if(sscanf(str, "graphics_frame_rate = %f", &cfg.graphics_conf.frame_rate) != 1)
+                if(sscanf(str, "graphics_shader_cache = %ms", &cfg.graphics_conf.shader_cache) != 1)
+                if(sscanf(str, "graphics_offscreen = %ms", &offscreen) != 1)
+                if(sscanf(str, "graphics_readback_file = %ms", &cfg.graphics_conf.readback_file) != 1)
+                if(sscanf(str, "graphics_readback_interval = %u", &cfg.graphics_conf.readback_interval) != 1)
                 if(sscanf(str, "imu_device = %ms", &cfg.imu_device) != 1)
                 if(sscanf(str, "imu_gyro_offset_x = %f", &cfg.imu_conf.gyro_offset[0]) != 1)
                 if(sscanf(str, "imu_gyro_offset_y = %f", &cfg.imu_conf.gyro_offset[1]) != 1)
@@ -190,19 +260,50 @@ int main(int argc, char *argv[])
                     }
                     free(interlace);
                 }
+
+                if(event_loop) parse_bool(event_loop, &cfg.app_event_loop);
+                if(dmabuf) parse_bool(dmabuf, &cfg.video_conf.dmabuf);
+                if(latest) parse_bool(latest, &cfg.video_conf.latest);
+                if(replay_loop) parse_bool(replay_loop, &cfg.video_conf.replay_loop);
+                if(decode_yuv) parse_bool(decode_yuv, &cfg.video_conf.decode_yuv);
+                if(offscreen) parse_bool(offscreen, &cfg.graphics_conf.offscreen);
+                if(font_sdf) parse_bool(font_sdf, &cfg.graphics_font_sdf);
+
+                if(replay)
+                {
+                    if(!strcmp(replay, "recorded"))
+                    {
+                        cfg.video_conf.replay = VIDEO_REPLAY_RECORDED;
+                    }
+                    else if(!strcmp(replay, "fixed"))
+                    {
+                        cfg.video_conf.replay = VIDEO_REPLAY_FIXED;
+                    }
+                    else if(!strcmp(replay, "fast"))
+                    {
+                        cfg.video_conf.replay = VIDEO_REPLAY_FAST;
+                    }
+                    else
+                    {
+                        WARN("Parse error");
+                    }
+                    free(replay);
+                }
             }
 
             fclose(f);
         }
     }
 
-    // Create window
-    cfg.app_window_id = window_create(cfg.window_width, cfg.window_height);
+    // Create window, offscreen rendering needs none
+    if(!cfg.graphics_conf.offscreen) cfg.app_window_id = window_create(cfg.window_width, cfg.window_height);
 
     // Start application
-    application_t *app = application_init(&cfg);
+    app = application_init(&cfg);
     if(app)
     {
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
         application_mainloop(app);
         application_free(app);
         return EXIT_SUCCESS;
@@ -0,0 +1,147 @@
+/*
+ * Frame profiler
+ *
+ * Copyright (C) 2013 - Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at
+ * <http://www.gnu.org/licenses>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "debug.h"
+#include "profile.h"
+
+/* Number of recent scopes kept in the ring */
+#define PROFILE_RECORDS 4096
+
+/* Period of statistics logging in seconds */
+#define PROFILE_DUMP_PERIOD 5
+
+/* Ring of scopes, each packed as stage + 1 in upper and nanoseconds in lower half, zero is empty */
+static _Atomic uint64_t ring[PROFILE_RECORDS];
+static atomic_uint head;
+
+/* Time of last statistics logging */
+static struct timespec last_dump;
+
+/* Statistics are logged at info level regardless of TRACE_LEVEL, profiling is enabled explicitly */
+#define PROFILE_LOG(msg, ...) _debug_printf(3, __FILE__, __LINE__, msg, ##__VA_ARGS__)
+
+static const char *stage_names[PROFILE_STAGE_NUM] =
+{
+    "video read",
+    "decode",
+    "upload",
+    "projection",
+    "label",
+    "HUD text",
+    "swap",
+    "frame"
+};
+
+void _profile_record(enum profile_stage stage, const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Durations are saturated at 4 s
+    int64_t ns = (int64_t)(end.tv_sec - start->tv_sec) * 1000000000 + (end.tv_nsec - start->tv_nsec);
+    if(ns > UINT32_MAX) ns = UINT32_MAX;
+
+    unsigned int index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed) % PROFILE_RECORDS;
+    atomic_store_explicit(&ring[index], ((uint64_t)(stage + 1) << 32) | (uint64_t)ns, memory_order_relaxed);
+}
+
+void _profile_tick(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if(last_dump.tv_sec == 0)
+    {
+        last_dump = now;
+    }
+    else if(now.tv_sec - last_dump.tv_sec >= PROFILE_DUMP_PERIOD)
+    {
+        last_dump = now;
+        profile_dump();
+    }
+}
+
+static int duration_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+void profile_get_stats(enum profile_stage stage, struct profile_stats *stats)
+{
+    DEBUG("profile_get_stats()");
+    assert(stage < PROFILE_STAGE_NUM);
+    assert(stats != 0);
+
+    // Collect durations of the stage
+    uint32_t durations[PROFILE_RECORDS];
+    uint64_t sum = 0;
+    int i, num = 0;
+    memset(stats, 0, sizeof(struct profile_stats));
+    for(i = 0; i < PROFILE_RECORDS; i++)
+    {
+        uint64_t record = atomic_load_explicit(&ring[i], memory_order_relaxed);
+        if((record >> 32) != stage + 1) continue;
+
+        uint32_t ns = (uint32_t)record;
+        durations[num++] = ns;
+        sum += ns;
+
+        int bin = 0;
+        while((bin < PROFILE_BINS - 1) && (ns >= 1000u << bin)) bin++;
+        stats->histogram[bin]++;
+    }
+    if(num == 0) return;
+
+    qsort(durations, num, sizeof(uint32_t), duration_compare);
+    stats->count = num;
+    stats->mean = sum / 1e6 / num;
+    stats->p50 = durations[(num - 1) / 2] / 1e6;
+    stats->p95 = durations[(num * 95 - 1) / 100] / 1e6;
+    stats->max = durations[num - 1] / 1e6;
+}
+
+void profile_dump(void)
+{
+    DEBUG("profile_dump()");
+
+    int stage;
+    for(stage = 0; stage < PROFILE_STAGE_NUM; stage++)
+    {
+        struct profile_stats stats;
+        profile_get_stats(stage, &stats);
+        if(stats.count == 0) continue;
+
+        // Print only occupied bins as upper bound in microseconds and count
+        char histogram[128];
+        int i, len = 0;
+        histogram[0] = 0;
+        for(i = 0; (i < PROFILE_BINS) && (len < sizeof(histogram)); i++)
+        {
+            if(stats.histogram[i]) len += snprintf(histogram + len, sizeof(histogram) - len, " <%u:%u", 1u << i, stats.histogram[i]);
+        }
+
+        PROFILE_LOG("Profile %s: %u scopes, mean %.3f ms, p50 %.3f ms, p95 %.3f ms, max %.3f ms, histogram [us]%s",
+                    stage_names[stage], stats.count, stats.mean, stats.p50, stats.p95, stats.max, histogram);
+    }
+}
@@ -0,0 +1,112 @@
+/**
+ * @file
+ * @brief       Frame profiler
+ * @author      Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * @section LICENSE
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at
+ * <http://www.gnu.org/licenses>
+ *
+ * @section DESCRIPTION
+ * These are macros used to measure durations of frame processing stages.
+ * Each `PROFILE_BEGIN()` and `PROFILE_END()` scope reads the monotonic clock
+ * and writes its duration into a fixed size lock-free ring shared by all threads.
+ * Statistics of the recent scopes are computed by `profile_get_stats()`
+ * and periodically logged by `PROFILE_TICK()` or at once by `PROFILE_DUMP()`.
+ * The macros are compiled only if PROFILE is defined, otherwise they have no overhead.
+ *
+ * Example:
+ * @code
+ * PROFILE_BEGIN(SWAP);
+ * eglSwapBuffers(display, surface);
+ * PROFILE_END(SWAP);
+ * @endcode
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Number of histogram bins, bin n counts durations below 2^n microseconds
+ */
+#define PROFILE_BINS 20
+
+/**
+ * @brief Profiled stages
+ */
+enum profile_stage
+{
+    PROFILE_VIDEO_READ = 0,     //!< Waiting for and reading video frame
+    PROFILE_DECODE,             //!< JPEG decoding
+    PROFILE_UPLOAD,             //!< Texture upload or import
+    PROFILE_PROJECTION,         //!< Landmark projection and drawing
+    PROFILE_LABEL,              //!< Label creation
+    PROFILE_HUD_TEXT,           //!< HUD text layout
+    PROFILE_SWAP,               //!< Buffer swap
+    PROFILE_FRAME,              //!< Whole frame rendering
+    PROFILE_STAGE_NUM
+};
+
+/**
+ * @brief Stage statistics of the recent scopes
+ */
+struct profile_stats
+{
+    /**
+     * @brief Number of scopes
+     */
+    uint32_t count;
+
+    /**
+     * @brief Mean, median, 95th percentile and maximum duration in milliseconds
+     */
+    float mean, p50, p95, max;
+
+    /**
+     * @brief Duration histogram, bin n counts durations below 2^n microseconds
+     */
+    uint32_t histogram[PROFILE_BINS];
+};
+
+//! @cond
+void _profile_record(enum profile_stage stage, const struct timespec *start);
+void _profile_tick(void);
+//! @endcond
+
+#ifdef PROFILE
+#define PROFILE_BEGIN(stage) struct timespec _profile_##stage; clock_gettime(CLOCK_MONOTONIC, &_profile_##stage)
+#define PROFILE_END(stage) _profile_record(PROFILE_##stage, &_profile_##stage)
+#define PROFILE_TICK() _profile_tick()
+#define PROFILE_DUMP() profile_dump()
+#else
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#define PROFILE_TICK()
+#define PROFILE_DUMP()
+#endif
+
+/**
+ * @brief Gets statistics of a stage from the recent scopes
+ * @param stage Profiled stage
+ * @param[out] stats Statistics structure
+ */
+void profile_get_stats(enum profile_stage stage, struct profile_stats *stats);
+
+/**
+ * @brief Logs statistics of all stages
+ * @note Statistics are logged at any TRACE_LEVEL
+ */
+void profile_dump(void);
+
+#endif /* PROFILE_H */
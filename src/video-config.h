@@ -0,0 +1,91 @@
+/**
+ * @file
+ * @brief       Video utilities - configuration
+ * @author      Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * @section LICENSE
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at
+ * <http://www.gnu.org/licenses>
+ *
+ * @section DESCRIPTION
+ * These are configuration definitions for video utilities.
+ */
+
+#ifndef VIDEO_CONFIG_H
+#define VIDEO_CONFIG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Video configuration structure
+ */
+struct video_config
+{
+    /**
+     * @brief Number of requested buffers, 0 for default
+     */
+    uint32_t buffer_count;
+
+    /**
+     * @brief Drain mode, always return the newest frame and skip older ones
+     */
+    bool latest;
+
+    /**
+     * @brief Export buffers as DMABUF file descriptors
+     * @note A drawn buffer is held until the next one is drawn, see `video_hold()`
+     */
+    bool dmabuf;
+
+    /**
+     * @brief Pacing of frames replayed from recorded file
+     */
+    enum video_replay
+    {
+        VIDEO_REPLAY_RECORDED = 0,  //!< Recorded rate from the index file (fixed rate if there is no index)
+        VIDEO_REPLAY_FIXED,         //!< Fixed rate given by `replay_fps`
+        VIDEO_REPLAY_FAST           //!< As fast as possible
+    }
+    replay;
+
+    /**
+     * @brief Frame rate for fixed rate replay
+     */
+    float replay_fps;
+
+    /**
+     * @brief Restart the replay at the end of file
+     */
+    bool replay_loop;
+
+    /**
+     * @brief Number of MJPEG decoder threads of the capture stage, 0 or 1 decodes on the capture thread
+     */
+    uint32_t decoder_count;
+
+    /**
+     * @brief Capture stage decodes MJPEG to YUV planes instead of RGBx, leaving conversion to the shader
+     */
+    bool decode_yuv;
+
+    /**
+     * @brief Minimal width of MJPEG frames decoded by capture stage, 0 for full size
+     */
+    uint32_t decode_width;
+
+    /**
+     * @brief Minimal height of MJPEG frames decoded by capture stage, 0 for full size
+     */
+    uint32_t decode_height;
+};
+
+#endif /* VIDEO_CONFIG_H */
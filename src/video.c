@@ -17,19 +17,52 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <linux/videodev2.h>
 
 #include "debug.h"
 #include "video.h"
 
-// Requested buffer count
+// Default requested buffer count
 #define BUFFER_COUNT    4
 
+// Maximum buffer count
+#define BUFFER_MAX      VIDEO_MAX_FRAME
+
+// Default replay frame rate
+#define REPLAY_FPS      30
+
+struct replay
+{
+    // Memory mapped file
+    uint8_t *map;
+    size_t size;
+
+    // Frame index, timestamps in nanoseconds
+    struct
+    {
+        size_t offset, length;
+        uint64_t timestamp;
+    }
+    *frames;
+    uint32_t count, position, sequence;
+
+    // Pacing
+    enum video_replay mode;
+    float fps;
+    bool loop;
+    uint64_t start;
+};
+
 struct _video
 {
     // Device file descriptor
@@ -40,26 +73,279 @@ struct _video
     {
         void *start;
         size_t length;
+        int fd;
     }
-    buffers[BUFFER_COUNT];
+    buffers[BUFFER_MAX];
 
     // Number of buffers mapped
     size_t count;
 
+    // Drain mode, only the newest buffer is returned
+    bool latest;
+
+    // Number of frames skipped in drain mode
+    uint32_t skipped;
+
+    // Current frame timestamp and sequence
+    uint64_t timestamp;
+    uint32_t sequence;
+
+    // Frame statistics, intervals and delays in nanoseconds
+    uint32_t frames, missed, delayed;
+    double interval_mean, interval_m2;
+    double delay_sum, delay_max;
+
+    // Line length in bytes
+    uint32_t stride;
+
+    // Buffers are exported as DMABUF
+    bool exported;
+
     // Index of currently processed buffer
     int index;
+
+    // Index of buffer kept dequeued while it is sampled by GPU, -1 if none
+    int held;
+
+    // Recorded file source, NULL for capture device
+    struct replay *replay;
 };
 
-video_t *video_open(const char *device, uint32_t width, uint32_t height, const char format[4], bool interlace)
+/* Gets monotonic time in nanoseconds */
+static uint64_t monotonic_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Updates statistics with dequeued buffer */
+static void frame_stats(video_t *video, const struct v4l2_buffer *buf)
+{
+    uint64_t timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + (uint64_t)buf->timestamp.tv_usec * 1000ull;
+    if(video->frames)
+    {
+        // Detect lost frames
+        if(buf->sequence - video->sequence > 1) video->missed += buf->sequence - video->sequence - 1;
+
+        // Running variance of frame intervals
+        double interval = (double)(timestamp - video->timestamp) / (buf->sequence - video->sequence ? buf->sequence - video->sequence : 1);
+        double diff = interval - video->interval_mean;
+        video->interval_mean += diff / video->frames;
+        video->interval_m2 += diff * (interval - video->interval_mean);
+    }
+
+    if((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    {
+        // Delay between capture and dequeue
+        double delay = (double)(monotonic_time() - timestamp);
+        video->delay_sum += delay;
+        video->delay_max = delay > video->delay_max ? delay : video->delay_max;
+        video->delayed++;
+    }
+
+    video->timestamp = timestamp;
+    video->sequence = buf->sequence;
+    video->frames++;
+}
+
+/* Appends frame to replay index */
+static void replay_add_frame(struct replay *replay, size_t offset, size_t length, uint64_t timestamp)
+{
+    if((replay->count & (replay->count - 1)) == 0)
+    {
+        replay->frames = realloc(replay->frames, (replay->count ? replay->count * 2 : 1) * sizeof(*replay->frames));
+        assert(replay->frames != 0);
+    }
+
+    replay->frames[replay->count].offset = offset;
+    replay->frames[replay->count].length = length;
+    replay->frames[replay->count].timestamp = timestamp;
+    replay->count++;
+}
+
+/* Opens recorded file and builds its frame index */
+static struct replay *replay_open(const char *file, uint32_t width, uint32_t height, const char format[4], const struct video_config *config)
+{
+    struct replay *replay = calloc(1, sizeof(struct replay));
+    assert(replay != 0);
+
+    replay->mode = config->replay;
+    replay->fps = config->replay_fps > 0 ? config->replay_fps : REPLAY_FPS;
+    replay->loop = config->replay_loop;
+
+    // Map file
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if((fd == -1) || (fstat(fd, &st) == -1) || (st.st_size == 0))
+    {
+        WARN("Failed to open `%s`", file);
+        if(fd != -1) close(fd);
+        free(replay);
+        return NULL;
+    }
+    replay->size = st.st_size;
+    replay->map = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(replay->map == MAP_FAILED)
+    {
+        WARN("Failed to map `%s`", file);
+        free(replay);
+        return NULL;
+    }
+    madvise(replay->map, replay->size, MADV_SEQUENTIAL);
+
+    // Load index file
+    char name[strlen(file) + 5];
+    sprintf(name, "%s.idx", file);
+    FILE *f = fopen(name, "r");
+    if(f)
+    {
+        unsigned long long timestamp, offset, length;
+        while(fscanf(f, "%llu %llu %llu", &timestamp, &offset, &length) == 3)
+        {
+            if(offset + length > replay->size)
+            {
+                WARN("Index entry out of file bounds");
+                break;
+            }
+            replay_add_frame(replay, offset, length, timestamp * 1000);
+        }
+        fclose(f);
+        INFO("Loaded index `%s`", name);
+    }
+    else
+    {
+        // Recorded rate is not known without index
+        if(replay->mode == VIDEO_REPLAY_RECORDED) replay->mode = VIDEO_REPLAY_FIXED;
+
+        if(strncmp(format, "MJPG", 4) == 0)
+        {
+            // Split by JPEG start and end of image markers
+            size_t i, start = 0;
+            bool image = false;
+            for(i = 0; i + 1 < replay->size; i++)
+            {
+                if(replay->map[i] != 0xFF) continue;
+                if(!image && (replay->map[i + 1] == 0xD8))
+                {
+                    start = i;
+                    image = true;
+                }
+                else if(image && (replay->map[i + 1] == 0xD9))
+                {
+                    replay_add_frame(replay, start, i + 2 - start, 0);
+                    image = false;
+                }
+            }
+        }
+        else
+        {
+            // Split by frame size
+            size_t i, length = 0;
+            if(strncmp(format, "RGB4", 4) == 0) length = width * height * 4;
+            else if(strncmp(format, "YUYV", 4) == 0) length = width * height * 2;
+            else if(strncmp(format, "NV12", 4) == 0) length = width * height * 3 / 2;
+            else WARN("Unknown frame size for `%.4s` format", format);
+
+            for(i = 0; length && (i + length <= replay->size); i += length) replay_add_frame(replay, i, length, 0);
+        }
+    }
+
+    if(replay->count == 0)
+    {
+        WARN("No frames in `%s`", file);
+        munmap(replay->map, replay->size);
+        free(replay->frames);
+        free(replay);
+        return NULL;
+    }
+
+    INFO("Replaying %u frames from `%s`", replay->count, file);
+    return replay;
+}
+
+/* Serves next frame from recorded file */
+static int replay_read(video_t *video, void **data, size_t *length)
+{
+    struct replay *replay = video->replay;
+    if(replay->position == replay->count)
+    {
+        if(!replay->loop)
+        {
+            INFO("End of recorded file");
+            return 0;
+        }
+        replay->position = 0;
+    }
+
+    // Restart timing at the first frame
+    uint64_t now = monotonic_time();
+    if(replay->position == 0) replay->start = now;
+
+    uint64_t target = now;
+    switch(replay->mode)
+    {
+        case VIDEO_REPLAY_RECORDED:
+            target = replay->start + (replay->frames[replay->position].timestamp - replay->frames[0].timestamp);
+            break;
+
+        case VIDEO_REPLAY_FIXED:
+            target = replay->start + (uint64_t)(replay->position * 1e9 / replay->fps);
+            break;
+
+        case VIDEO_REPLAY_FAST:
+        default:
+            break;
+    }
+
+    // Wait for the frame time
+    if(target > now)
+    {
+        struct timespec ts = { .tv_sec = target / 1000000000ull, .tv_nsec = target % 1000000000ull };
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+
+    // Account the frame as captured at its target time
+    struct v4l2_buffer buf;
+    bzero(&buf, sizeof(buf));
+    buf.timestamp.tv_sec = target / 1000000000ull;
+    buf.timestamp.tv_usec = target % 1000000000ull / 1000;
+    buf.sequence = replay->sequence++;
+    buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    frame_stats(video, &buf);
+
+    DEBUG("Replaying frame %u", replay->position);
+    if(data) *data = replay->map + replay->frames[replay->position].offset;
+    if(length) *length = replay->frames[replay->position].length;
+    replay->position++;
+    return 1;
+}
+
+video_t *video_open(const char *device, uint32_t width, uint32_t height, const char format[4], bool interlace, const struct video_config *config)
 {
     DEBUG("video_open()");
     assert(device != 0);
     assert(format != 0);
+    assert(config != 0);
 
     int i;
     video_t *video = calloc(1, sizeof(struct _video));
     assert(video != 0);
 
+    // Replay regular files
+    struct stat st;
+    if((stat(device, &st) == 0) && S_ISREG(st.st_mode))
+    {
+        if(!(video->replay = replay_open(device, width, height, format, config)))
+        {
+            free(video);
+            return NULL;
+        }
+        video->fd = -1;
+        return video;
+    }
+
     // Open device
     if((video->fd = open(device, O_RDWR | O_NONBLOCK)) == -1)
     {
@@ -82,10 +368,12 @@ video_t *video_open(const char *device, uint32_t width, uint32_t height, const c
         WARN("Failed to set video format");
         goto error;
     }
+    video->stride = fmt.fmt.pix.bytesperline;
 
     struct v4l2_requestbuffers reqbuf;
     bzero(&reqbuf, sizeof(reqbuf));
-    reqbuf.count = BUFFER_COUNT;
+    reqbuf.count = config->buffer_count ? config->buffer_count : BUFFER_COUNT;
+    reqbuf.count = reqbuf.count < BUFFER_MAX ? reqbuf.count : BUFFER_MAX;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     reqbuf.memory = V4L2_MEMORY_MMAP;
 
@@ -95,7 +383,7 @@ video_t *video_open(const char *device, uint32_t width, uint32_t height, const c
         WARN("Failed to request buffers");
         goto error;
     }
-    assert(reqbuf.count <= BUFFER_COUNT);
+    assert(reqbuf.count <= BUFFER_MAX);
 
     struct v4l2_buffer buf;
     for(i = 0; i < reqbuf.count; i++)
@@ -123,6 +411,29 @@ video_t *video_open(const char *device, uint32_t width, uint32_t height, const c
         else video->count++;
     }
 
+    if(config->dmabuf)
+    {
+        struct v4l2_exportbuffer expbuf;
+        for(i = 0; i < video->count; i++)
+        {
+            bzero(&expbuf, sizeof(expbuf));
+            expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            expbuf.index = i;
+            expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+            // Export buffer
+            if(ioctl(video->fd, VIDIOC_EXPBUF, &expbuf) == -1)
+            {
+                WARN("Failed to export buffer, DMABUF disabled");
+                break;
+            }
+            video->buffers[i].fd = expbuf.fd;
+        }
+
+        if(i == video->count) video->exported = true;
+        else while(--i >= 0) close(video->buffers[i].fd);
+    }
+
     for(i = 1; i < video->count; i++)
     {
         bzero(&buf, sizeof(buf));
@@ -146,13 +457,16 @@ video_t *video_open(const char *device, uint32_t width, uint32_t height, const c
         goto error;
     }
 
-    INFO("Capture started with %d buffers", video->count);
+    video->latest = config->latest;
+    video->held = -1;
+    INFO("Capture started with %d buffers%s%s", video->count, video->exported ? ", exported as DMABUF" : "", video->latest ? ", drain mode" : "");
     return video;
 
 error:
-    for(i = 0; video->count; i++)
+    for(i = 0; i < video->count; i++)
     {
         // Unmap buffer
+        if(video->exported) close(video->buffers[i].fd);
         munmap(video->buffers[i].start, video->buffers[i].length);
     }
     close(video->fd);
@@ -165,47 +479,164 @@ int video_read(video_t *video, void **data, size_t *length)
     DEBUG("video_read()");
     assert(video != 0);
 
+    if(video->replay) return replay_read(video, data, length);
+
     struct v4l2_buffer buf;
     bzero(&buf, sizeof(buf));
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
     buf.index = video->index;
 
-    // Enqueue previous buffer
-    if(ioctl(video->fd, VIDIOC_QBUF, &buf) == -1)
+    // Enqueue previous buffer, held buffer is enqueued by `video_hold()` once replaced
+    if((video->index != video->held) && (ioctl(video->fd, VIDIOC_QBUF, &buf) == -1))
     {
         WARN("Failed to enqueue buffer");
         return 0;
     }
 
-    // Block until new data is ready
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(video->fd, &fds);
-    select(video->fd + 1, &fds, NULL, NULL, NULL);
     bzero(&buf, sizeof(buf));
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
 
-    // Dequeue next buffer
-    if(ioctl(video->fd, VIDIOC_DQBUF, &buf) == -1)
+    // Dequeue next buffer, block only if none is ready yet
+    while(ioctl(video->fd, VIDIOC_DQBUF, &buf) == -1)
     {
-        WARN("Failed to dequeue buffer");
-        return 0;
+        if(errno != EAGAIN)
+        {
+            WARN("Failed to dequeue buffer");
+            return 0;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(video->fd, &fds);
+        select(video->fd + 1, &fds, NULL, NULL, NULL);
     }
-    assert(buf.index < BUFFER_COUNT);
+    frame_stats(video, &buf);
+
+    if(video->latest)
+    {
+        struct v4l2_buffer next;
+        bzero(&next, sizeof(next));
+        next.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        next.memory = V4L2_MEMORY_MMAP;
+
+        // Drain all ready buffers, keeping the newest one
+        while(ioctl(video->fd, VIDIOC_DQBUF, &next) != -1)
+        {
+            if(ioctl(video->fd, VIDIOC_QBUF, &buf) == -1)
+            {
+                WARN("Failed to enqueue buffer");
+                return 0;
+            }
+            buf = next;
+            video->skipped++;
+            frame_stats(video, &buf);
+        }
 
-    INFO("Dequeued buffer %d of size %d", buf.index, buf.bytesused);
+        if(errno != EAGAIN)
+        {
+            WARN("Failed to dequeue buffer");
+            return 0;
+        }
+    }
+    assert(buf.index < BUFFER_MAX);
+
+    INFO("Dequeued buffer %d of size %d, sequence %u", buf.index, buf.bytesused, buf.sequence);
     if(data) *data = video->buffers[video->index = buf.index].start;
     if(length) *length = buf.bytesused;
     return 1;
 }
 
+int video_hold(video_t *video)
+{
+    DEBUG("video_hold()");
+    assert(video != 0);
+
+    if(video->replay || (video->held == video->index)) return 1;
+
+    // Release the buffer drawn before, the current one replaces it
+    if(video->held != -1)
+    {
+        struct v4l2_buffer buf;
+        bzero(&buf, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = video->held;
+        if(ioctl(video->fd, VIDIOC_QBUF, &buf) == -1)
+        {
+            WARN("Failed to enqueue buffer");
+            return 0;
+        }
+    }
+
+    video->held = video->index;
+    return 1;
+}
+
+int video_get_fd(video_t *video)
+{
+    DEBUG("video_get_fd()");
+    assert(video != 0);
+
+    return video->fd;
+}
+
+int video_get_dmabuf(video_t *video, int *fd, uint32_t *stride)
+{
+    DEBUG("video_get_dmabuf()");
+    assert(video != 0);
+
+    if(!video->exported) return 0;
+    if(fd) *fd = video->buffers[video->index].fd;
+    if(stride) *stride = video->stride;
+    return 1;
+}
+
+void video_get_stats(video_t *video, struct video_stats *stats)
+{
+    DEBUG("video_get_stats()");
+    assert(video != 0);
+    assert(stats != 0);
+
+    stats->skipped = video->skipped;
+    stats->frames = video->frames;
+    stats->missed = video->missed;
+    stats->interval = video->interval_mean / 1e6;
+    stats->jitter = video->frames > 2 ? sqrt(video->interval_m2 / (video->frames - 2)) / 1e6 : 0;
+    stats->delay_mean = video->delayed ? video->delay_sum / video->delayed / 1e6 : 0;
+    stats->delay_max = video->delay_max / 1e6;
+}
+
+void video_get_frame_info(video_t *video, struct video_frame_info *info)
+{
+    DEBUG("video_get_frame_info()");
+    assert(video != 0);
+    assert(info != 0);
+
+    info->timestamp = video->timestamp;
+    info->sequence = video->sequence;
+}
+
 void video_close(video_t *video)
 {
     DEBUG("video_close()");
     assert(video != 0);
 
+    struct video_stats stats;
+    video_get_stats(video, &stats);
+    INFO("Capture stopped, %u frames, %u skipped, %u missed, interval %.2f ms, jitter %.2f ms, delay %.2f ms (max %.2f ms)",
+         stats.frames, stats.skipped, stats.missed, stats.interval, stats.jitter, stats.delay_mean, stats.delay_max);
+
+    if(video->replay)
+    {
+        munmap(video->replay->map, video->replay->size);
+        free(video->replay->frames);
+        free(video->replay);
+        free(video);
+        return;
+    }
+
     // Stop capture
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if(ioctl(video->fd, VIDIOC_STREAMOFF, &type) == -1)
@@ -217,6 +648,7 @@ void video_close(video_t *video)
     for(i = 0; i < video->count; i++)
     {
         // Unmap buffer
+        if(video->exported) close(video->buffers[i].fd);
         munmap(video->buffers[i].start, video->buffers[i].length);
     }
 
@@ -19,13 +19,22 @@
  * This is a utility library for simple usage of Linux video devices (V4L2).
  * Use `video_open()` to open and initialize video device.
  * Then you may use `video_read()` to get video frames out of the device.
- * @note `video_read()` is a blocking call
+ * If enabled in configuration, buffers are also exported as DMABUF descriptors available by `video_get_dmabuf()`.
+ *
+ * Instead of a device, a recorded file may be given to `video_open()`.
+ * The file is memory mapped and its frames are returned without copying, paced according to the configuration.
+ * It holds either raw frames of the given format or concatenated JPEG images for "MJPG".
+ * Optional index file of the same name with `.idx` suffix lists one frame per line as
+ * `<timestamp in microseconds> <offset in bytes> <length in bytes>`,
+ * without index the frames are split by size or by JPEG markers.
+ * @note `video_read()` is a blocking call, unless the descriptor returned by `video_get_fd()` was polled readable
  *
  * Example:
  * @code
  * int main()
  * {
- *     video_t *video = video_open("/dev/video0", 800, 600, "RGB4", false);
+ *     struct video_config config = { .buffer_count = 4, .latest = true };
+ *     video_t *video = video_open("/dev/video0", 800, 600, "RGB4", false, &config);
  *     void *buffer;
  *     size_t length;
  *
@@ -45,21 +54,81 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "video-config.h"
+
 /**
  * @brief Internal object
  */
 typedef struct _video video_t;
 
+/**
+ * @brief Video statistics
+ */
+struct video_stats
+{
+    /**
+     * @brief Frames dequeued from the device
+     */
+    uint32_t frames;
+
+    /**
+     * @brief Frames skipped in drain mode
+     */
+    uint32_t skipped;
+
+    /**
+     * @brief Frames lost by the driver, detected from sequence numbers
+     */
+    uint32_t missed;
+
+    /**
+     * @brief Mean frame interval in milliseconds
+     */
+    float interval;
+
+    /**
+     * @brief Standard deviation of frame interval in milliseconds
+     */
+    float jitter;
+
+    /**
+     * @brief Mean delay from capture to dequeue in milliseconds
+     */
+    float delay_mean;
+
+    /**
+     * @brief Maximum delay from capture to dequeue in milliseconds
+     */
+    float delay_max;
+};
+
+/**
+ * @brief Video frame information
+ */
+struct video_frame_info
+{
+    /**
+     * @brief Capture timestamp in nanoseconds (CLOCK_MONOTONIC for most drivers)
+     */
+    uint64_t timestamp;
+
+    /**
+     * @brief Frame sequence number
+     */
+    uint32_t sequence;
+};
+
 /**
  * @brief Opens video device and starts the capture
- * @param device Device name eg. "/dev/video0"
+ * @param device Device name eg. "/dev/video0" or recorded file name
  * @param width Video frame width in pixels
  * @param height Video frame height in pixels
  * @param format Video format in fourcc notation eg. "RGB4"
  * @param interlace Video interlacing (0 - disabled, 1 - enabled)
+ * @param config Pointer to video configuration structure
  * @return Video object or NULL on error
  */
-video_t *video_open(const char *device, uint32_t width, uint32_t height, const char format[4], bool interlace);
+video_t *video_open(const char *device, uint32_t width, uint32_t height, const char format[4], bool interlace, const struct video_config *config);
 
 /**
  * @brief Synchronously reads next video frame
@@ -68,9 +137,50 @@ video_t *video_open(const char *device, uint32_t width, uint32_t height, const c
  * @param[out] length Pointer to data length
  * @return 1 on success or 0 on error
  * @note Each call to `video_read()` invalidates previous buffer.
+ * @note In drain mode all ready buffers are dequeued and only the newest one is returned.
  */
 int video_read(video_t *video, void **data, size_t *length);
 
+/**
+ * @brief Gets information about the frame returned by last `video_read()`
+ * @param video Object returned by `video_open()`
+ * @param[out] info Frame information structure
+ */
+void video_get_frame_info(video_t *video, struct video_frame_info *info);
+
+/**
+ * @brief Keeps the buffer returned by last `video_read()` dequeued, releases the one held before
+ * @param video Object returned by `video_open()`
+ * @return 1 on success, 0 on error
+ * @note Call after a frame imported from DMABUF was drawn, so the device does not overwrite a buffer the GPU may still sample.
+ * The held buffer is not available for capture, configure at least three buffers.
+ */
+int video_hold(video_t *video);
+
+/**
+ * @brief Gets device file descriptor for polling
+ * @param video Object returned by `video_open()`
+ * @return File descriptor or -1 when replaying a file
+ */
+int video_get_fd(video_t *video);
+
+/**
+ * @brief Gets DMABUF descriptor of the buffer returned by last `video_read()`
+ * @param video Object returned by `video_open()`
+ * @param[out] fd DMABUF file descriptor
+ * @param[out] stride Line length in bytes
+ * @return 1 on success or 0 if buffers are not exported
+ * @note Descriptor is owned by the video object and stays valid until `video_close()`.
+ */
+int video_get_dmabuf(video_t *video, int *fd, uint32_t *stride);
+
+/**
+ * @brief Gets video statistics
+ * @param video Object returned by `video_open()`
+ * @param[out] stats Statistics structure
+ */
+void video_get_stats(video_t *video, struct video_stats *stats);
+
 /**
  * @brief Stops the capture and frees all resources
  * @param video Object returned by `video_open()`